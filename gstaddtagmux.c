@@ -33,6 +33,103 @@
  * Each buffer of such is turned into an image tag, the type of which
  * may be specified by an image-type field of an upstream capsfilter element.
  * Use a jpegparse element upstream to send a complete image in each buffer.
+ * Otherwise, set the accumulate property of its sink pad
+ * to make one image of all the buffers of the stream.
+ * When such a stream has fixed image (or text/uri-list) caps, these are
+ * trusted to describe each buffer, which is then not typefound
+ * (unless trust-caps is FALSE).
+ *
+ * While the main stream is blocked, its buffers and serialized events are
+ * held in a queue, so that upstream keeps producing while the additional
+ * streams are being read.
+ * Only when the queue is full (see the max-size-buffers, max-size-bytes and
+ * max-size-time properties) or upon end of the main stream does the main
+ * stream wait.
+ * Held content is pushed downstream when they are released.
+ * The tags go with it, after the stream-start, caps and segment events
+ * of the main stream and before anything else.
+ * With a merge-mode, they are instead merged into the first stream tag event
+ * of the main stream (when it comes before its first buffer)
+ * so that downstream sees one complete tag list.
+ * After a flushing seek, the same (final) tags are pushed again,
+ * in the same way, without waiting for anything.
+ * In pull mode, ranges are pulled straight through the sink pad.
+ *
+ * More main streams may go through the element, each from a requested
+ * main_sink_%u pad to its main_src_%u pad.
+ * Each is queued and held on its own, until the tags are made,
+ * and then pushes the same tags.
+ *
+ * An additional stream is only waited for while its pad is linked.
+ * One that is unlinked, released, flushed or refused before it ends
+ * is dropped.
+ *
+ * The main stream need not wait for every additional stream.
+ * One that is not required (see the sink pad's required property)
+ * is only waited for while the main stream is queued.
+ * No stream is waited for beyond the timeout property.
+ * The tags of those that end after the main stream is released
+ * are dropped unless late-tags is TRUE, in which case all the tags
+ * are pushed again.
+ * Tags from additional streams of higher priority (another pad property)
+ * come first, otherwise they are in the order their pads were requested.
+ * With dedupe, only the first image of the same content and image-type
+ * is kept.
+ * JPEG images are scaled down to fit within max-width and max-height,
+ * when set, without the need for decoder, scaler and encoder elements.
+ * The width and height of each JPEG or PNG image (from its header)
+ * are added to the caps of its sample.
+ * By these, select may keep only one image of each image-type
+ * (the first or largest that fits) before any are scaled.
+ *
+ * When the main stream already has an image of the passthrough image-type,
+ * in a tag event or a FLAC PICTURE metadata block at its start,
+ * it is passed through without waiting and without our tags.
+ * So it is, with probe-downstream, when no tag writer downstream
+ * (past encoders, muxers, tees and bins) would keep images,
+ * as found when the main stream is negotiated.
+ *
+ * For Ogg/Vorbis (or other vorbis comment) output,
+ * picture-comments replaces image tags with METADATA_BLOCK_PICTURE
+ * extended comments, which are written as is.
+ * Each is encoded once and, when the cache is enabled,
+ * reused for the same image by the elements of this process.
+ *
+ * Images are held until the main stream is released.
+ * max-bytes limits what is held for a sink pad, for the element
+ * or (process-max-bytes) for all addtagmux elements in the process.
+ * An image beyond a limit is dropped, scaled down (JPEG only)
+ * or posts an error, as over-budget says.
+ *
+ * When the main stream is released, an element message is posted
+ * with the same structure as the stats property:
+ * how long the main stream waited, how long was spent typefinding,
+ * how many bytes each additional stream sent
+ * and how big the tags pushed were.
+ *
+ * With resolve-uris, each local (file:) URI of a text/uri-list
+ * additional stream is mapped into memory and made into an image
+ * on a pool of threads, so that one such stream can add many images.
+ * The stream ends when all have been made.
+ *
+ * With a cache-directory, JPEG images scaled by an additional stream
+ * are kept in files, by content, size and image-type,
+ * for any process that uses the same directory.
+ * Its index is mapped into memory (shared) and changed only while locked;
+ * a cached image is mapped into memory too, rather than read.
+ * The least recently used are removed to stay within
+ * cache-directory-max-bytes.
+ *
+ * Image files may also be found, by name, in a cover-directory
+ * (that of the main stream's file): for each image-type,
+ * the first of its cover-patterns (globs, ignoring case) to match a name.
+ * What is in a directory is remembered, process-wide,
+ * until its modification time changes,
+ * so that the songs of an album read it once.
+ *
+ * Image files may also be named by the location property.
+ * These are mapped into memory and added as tags
+ * without any additional streams.
  *
  * <refsect2>
  * <title>Example launch line</title>
@@ -59,21 +156,161 @@
 #include "config.h"
 #endif
 
+#include <string.h>
+#include <sys/stat.h>
+
 #include <gst/gst.h>
 #include <gst/gstpad.h>
 #include <gst/base/gsttypefindhelper.h>
 #include <gst/tag/tag.h>
 
 #include "gstaddtagmux.h"
+#include "gstaddtagmuxcache.h"
+#include "gstaddtagmuxdisk.h"
+#include "gstaddtagmuxfolder.h"
+#include "gstaddtagmuxjpeg.h"
+#include "gstaddtagmuxpicture.h"
+#include "gstaddtagmuxprobe.h"
 
 GST_DEBUG_CATEGORY_STATIC(gst_add_tag_mux_debug_category);
 #define GST_CAT_DEFAULT gst_add_tag_mux_debug_category
 
-/// No properties supported yet
+/// The max-size-* properties bound the queue that holds the main stream
+/// while additional streams are pending.
+/// As with the queue element, a limit of 0 is unlimited.
+/// cache-max-bytes is process-wide, setting it affects all instances.
+/// location names image files to add as tags without additional streams.
+/// trust-caps uses fixed image caps of additional streams
+/// instead of typefinding each buffer.
+/// timeout bounds how long the main stream waits for additional streams
+/// and late-tags pushes the tags of those that end after that.
+/// dedupe drops an image tag with the same content and image-type
+/// as one before it.
+/// max-width and max-height scale JPEG images down to fit.
+/// select keeps only one image of each image-type, by size.
+/// stats (read-only) says what happened up to the last release.
+/// max-bytes limits the images held until release, for all our pads,
+/// and process-max-bytes for all addtagmux elements in this process.
+/// over-budget says what to do with an image beyond a limit.
+/// passthrough is an image-type that, when the main stream already has it,
+/// releases the main stream without our tags.
+/// merge-mode merges our tags into the first stream tag event
+/// of the main stream, rather than pushing them in their own.
+/// picture-comments replaces image tags with METADATA_BLOCK_PICTURE
+/// comments, encoded once, for vorbis comment writers.
+/// resolve-uris makes images of the local files of a text/uri-list.
+/// cache-directory keeps scaled images in files, for all addtagmux elements
+/// in all processes that use it, within cache-directory-max-bytes.
+/// Both are process-wide.
+/// cover-directory is a folder (that of the main stream's file)
+/// in which to find image files whose names match cover-patterns.
+enum {
+    PROP_0,
+    PROP_MAX_SIZE_BUFFERS,
+    PROP_MAX_SIZE_BYTES,
+    PROP_MAX_SIZE_TIME,
+    PROP_CACHE_MAX_BYTES,
+    PROP_LOCATION,
+    PROP_TRUST_CAPS,
+    PROP_TIMEOUT,
+    PROP_LATE_TAGS,
+    PROP_DEDUPE,
+    PROP_MAX_WIDTH,
+    PROP_MAX_HEIGHT,
+    PROP_SELECT,
+    PROP_STATS,
+    PROP_MAX_BYTES,
+    PROP_PROCESS_MAX_BYTES,
+    PROP_OVER_BUDGET,
+    PROP_PASSTHROUGH,
+    PROP_MERGE_MODE,
+    PROP_PICTURE_COMMENTS,
+    PROP_RESOLVE_URIS,
+    PROP_CACHE_DIRECTORY,
+    PROP_CACHE_DIRECTORY_MAX_BYTES,
+    PROP_COVER_DIRECTORY,
+    PROP_COVER_PATTERNS,
+    PROP_PROBE_DOWNSTREAM,
+};
+
+/// required pads are waited for (until timeout),
+/// others only while the main stream is queued.
+/// Tags from pads of higher priority come first.
+/// accumulate makes one image of all the buffers of a stream
+/// (no bigger than accumulate-max-bytes) instead of one from each.
+/// max-bytes limits the images of a pad held until release.
 enum {
-    PROP_0
+    PROP_PAD_0,
+    PROP_PAD_REQUIRED,
+    PROP_PAD_PRIORITY,
+    PROP_PAD_ACCUMULATE,
+    PROP_PAD_ACCUMULATE_MAX_BYTES,
+    PROP_PAD_MAX_BYTES,
 };
 
+#define DEFAULT_MAX_SIZE_BUFFERS	200
+#define DEFAULT_MAX_SIZE_BYTES		(10 * 1024 * 1024)
+#define DEFAULT_MAX_SIZE_TIME		GST_SECOND
+
+#define DEFAULT_COVER_PATTERNS \
+    "front-cover=cover.jpg" G_SEARCHPATH_SEPARATOR_S \
+    "front-cover=cover.png" G_SEARCHPATH_SEPARATOR_S \
+    "front-cover=folder.jpg" G_SEARCHPATH_SEPARATOR_S \
+    "front-cover=folder.png" G_SEARCHPATH_SEPARATOR_S \
+    "front-cover=front.*" G_SEARCHPATH_SEPARATOR_S \
+    "back-cover=back.*"
+
+#define DEFAULT_PAD_ACCUMULATE_MAX_BYTES	(16 * 1024 * 1024)
+
+#define OVER_BUDGET_SCALE_SIZE		160	// fit, when over budget
+
+/// Images held until release by all addtagmux elements in this process
+static struct {
+    GMutex		mutex;		// lock on everything below
+    guint64		bytes;		// held
+    guint64		max_bytes;	// limit on bytes, 0 is unlimited
+} budget;
+
+GType
+gst_add_tag_mux_select_get_type(void)
+{
+    static gsize type = 0;
+    static GEnumValue const values[] = {
+	{GST_ADD_TAG_MUX_SELECT_ALL,
+	    "Keep all images", "all"},
+	{GST_ADD_TAG_MUX_SELECT_FIRST_FIT,
+	    "First image that fits, else the first", "first-fit"},
+	{GST_ADD_TAG_MUX_SELECT_LARGEST_FIT,
+	    "Largest image that fits, else the smallest", "largest-fit"},
+	{0, NULL, NULL},
+    };
+    if (g_once_init_enter(&type)) {
+	g_once_init_leave(&type,
+	    g_enum_register_static("GstAddTagMuxSelect", values));
+    }
+    return type;
+}
+
+GType
+gst_add_tag_mux_over_budget_get_type(void)
+{
+    static gsize type = 0;
+    static GEnumValue const values[] = {
+	{GST_ADD_TAG_MUX_OVER_BUDGET_DROP,
+	    "Drop the image", "drop"},
+	{GST_ADD_TAG_MUX_OVER_BUDGET_SCALE,
+	    "Scale a JPEG image down to a thumbnail, else drop it", "scale"},
+	{GST_ADD_TAG_MUX_OVER_BUDGET_ERROR,
+	    "Post an error", "error"},
+	{0, NULL, NULL},
+    };
+    if (g_once_init_enter(&type)) {
+	g_once_init_leave(&type,
+	    g_enum_register_static("GstAddTagMuxOverBudget", values));
+    }
+    return type;
+}
+
 G_DEFINE_TYPE_WITH_CODE (
     GstAddTagMuxPad,
     gst_add_tag_mux_pad,
@@ -86,6 +323,20 @@ G_DEFINE_TYPE_WITH_CODE (
     )
 );
 
+/// Free samples resolved from a uri-list (some may be NULL)
+static void
+gst_add_tag_mux_resolved_free(
+    GPtrArray *		resolved)
+{
+    guint i;
+    for (i = 0; i < resolved->len; ++i) {
+	if (g_ptr_array_index(resolved, i)) {
+	    gst_sample_unref(g_ptr_array_index(resolved, i));
+	}
+    }
+    g_ptr_array_unref(resolved);
+}
+
 /// GObject disposal for GstAddTagMuxPad
 /// https://developer.gnome.org/gobject/stable/howto-gobject-destruction.html
 static void
@@ -104,10 +355,117 @@ gst_add_tag_mux_pad_finalize(
     GObject *		object)
 {
     GST_TRACE_OBJECT(object, ">");
+    GstAddTagMuxPad * addtagmuxpad = GST_ADD_TAG_MUX_PAD(object);
+    g_free(addtagmuxpad->cache_key);
+    if (addtagmuxpad->samples) {
+	g_ptr_array_unref(addtagmuxpad->samples);
+    }
+    if (addtagmuxpad->source) {
+	gst_object_unref(addtagmuxpad->source);
+    }
+    if (addtagmuxpad->caps) {
+	gst_caps_unref(addtagmuxpad->caps);
+    }
+    if (addtagmuxpad->taglist) {
+	gst_tag_list_unref(addtagmuxpad->taglist);
+    }
+    if (addtagmuxpad->accumulated) {
+	gst_buffer_unref(addtagmuxpad->accumulated);
+    }
+    if (addtagmuxpad->resolved) {
+	gst_add_tag_mux_resolved_free(addtagmuxpad->resolved);
+    }
+    g_cond_clear(&addtagmuxpad->resolve_cond);
     G_OBJECT_CLASS(gst_add_tag_mux_pad_parent_class)->finalize(object);
     GST_TRACE("<");
 }
 
+static void
+gst_add_tag_mux_pad_set_property(
+    GObject *		object,
+    guint		property_id,
+    GValue const *	value,
+    GParamSpec *	pspec)
+{
+    GST_TRACE_OBJECT(object, ">");
+    GstAddTagMuxPad * addtagmuxpad = GST_ADD_TAG_MUX_PAD(object);
+    GstObject * parent = gst_object_get_parent(GST_OBJECT(object));
+    GstAddTagMux * addtagmux = parent ? GST_ADD_TAG_MUX(parent) : NULL;
+    if (addtagmux) {
+	g_mutex_lock(&addtagmux->mutex);
+    }
+    switch (property_id) {
+	case PROP_PAD_REQUIRED: {
+	    gboolean required = g_value_get_boolean(value);
+	    // keep our element's count of required pending pads
+	    if (addtagmux && addtagmuxpad->pending
+		    && required != addtagmuxpad->required) {
+		if (required) {
+		    ++addtagmux->required;
+		} else if (!--addtagmux->required) {
+		    g_cond_broadcast(&addtagmux->cond);
+		}
+	    }
+	    addtagmuxpad->required = required;
+	    break;
+	}
+	case PROP_PAD_PRIORITY:
+	    addtagmuxpad->priority = g_value_get_int(value);
+	    break;
+	case PROP_PAD_ACCUMULATE:
+	    addtagmuxpad->accumulate = g_value_get_boolean(value);
+	    break;
+	case PROP_PAD_ACCUMULATE_MAX_BYTES:
+	    addtagmuxpad->accumulate_max_bytes = g_value_get_uint(value);
+	    break;
+	case PROP_PAD_MAX_BYTES:
+	    addtagmuxpad->max_bytes = g_value_get_uint(value);
+	    break;
+	default:
+	    G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
+	    break;
+    }
+    if (addtagmux) {
+	g_mutex_unlock(&addtagmux->mutex);
+    }
+    if (parent) {
+	gst_object_unref(parent);
+    }
+    GST_TRACE_OBJECT(object, "<");
+}
+
+static void
+gst_add_tag_mux_pad_get_property(
+    GObject *		object,
+    guint		property_id,
+    GValue *		value,
+    GParamSpec *	pspec)
+{
+    GST_TRACE_OBJECT(object, ">");
+    GstAddTagMuxPad * addtagmuxpad = GST_ADD_TAG_MUX_PAD(object);
+    switch (property_id) {
+	case PROP_PAD_REQUIRED:
+	    g_value_set_boolean(value, addtagmuxpad->required);
+	    break;
+	case PROP_PAD_PRIORITY:
+	    g_value_set_int(value, addtagmuxpad->priority);
+	    break;
+	case PROP_PAD_ACCUMULATE:
+	    g_value_set_boolean(value, addtagmuxpad->accumulate);
+	    break;
+	case PROP_PAD_ACCUMULATE_MAX_BYTES:
+	    g_value_set_uint(value, addtagmuxpad->accumulate_max_bytes);
+	    break;
+	case PROP_PAD_MAX_BYTES:
+	    g_value_set_uint(value, addtagmuxpad->max_bytes);
+	    break;
+	default:
+	    G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
+	    break;
+    }
+    GST_TRACE_OBJECT(object, "<");
+}
+
 static void
 gst_add_tag_mux_pad_class_init(
     GstAddTagMuxPadClass *	klass)
@@ -116,168 +474,1424 @@ gst_add_tag_mux_pad_class_init(
     GObjectClass * gobject_class = G_OBJECT_CLASS(klass);
     gobject_class->dispose	= gst_add_tag_mux_pad_dispose;
     gobject_class->finalize	= gst_add_tag_mux_pad_finalize;
+    gobject_class->set_property	= gst_add_tag_mux_pad_set_property;
+    gobject_class->get_property	= gst_add_tag_mux_pad_get_property;
+
+    g_object_class_install_property(gobject_class, PROP_PAD_REQUIRED,
+	g_param_spec_boolean("required", "Required",
+	    "Hold the main stream until this stream ends (or timeout)"
+		" rather than only while it is queued",
+	    TRUE,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class, PROP_PAD_PRIORITY,
+	g_param_spec_int("priority", "Priority",
+	    "Tags from streams of higher priority come first",
+	    G_MININT, G_MAXINT, 0,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class, PROP_PAD_ACCUMULATE,
+	g_param_spec_boolean("accumulate", "Accumulate",
+	    "Make one image of all buffers of the stream"
+		" rather than one of each (no parser needed)",
+	    FALSE,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class,
+	PROP_PAD_ACCUMULATE_MAX_BYTES,
+	g_param_spec_uint("accumulate-max-bytes", "Accumulated max. size",
+	    "Max. size of an accumulated image, beyond which it is dropped"
+		" (0=unlimited)",
+	    0, G_MAXUINT, DEFAULT_PAD_ACCUMULATE_MAX_BYTES,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class, PROP_PAD_MAX_BYTES,
+	g_param_spec_uint("max-bytes", "Max. size (bytes)",
+	    "Max. amount of images from this stream held until release"
+		" (0=unlimited)",
+	    0, G_MAXUINT, 0,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
     GST_TRACE("<");
 }
 
-static GstFlowReturn
-gst_add_tag_mux_pad_sink_chain_eos(
-    GstPad *		pad,
-    GstObject *		parent,
-    GstBuffer *		buffer)
+/// Convert a string to a GstTagImageType by name or nickname.
+/// Return FALSE if it is neither.
+static gboolean
+gst_add_tag_mux_image_type_from_string(
+    gchar const *	string,
+    GstTagImageType *	image_type)
 {
-    GST_TRACE_OBJECT(pad, ">");
-    GST_WARNING_OBJECT(pad, "EOS");
-    GST_TRACE_OBJECT(pad, "< EOS");
-    return GST_FLOW_EOS;
+    GEnumClass * e = g_type_class_ref(GST_TYPE_TAG_IMAGE_TYPE);
+    GEnumValue * v;
+    gboolean ret = 0
+	|| (v = g_enum_get_value_by_name(e, string))
+	|| (v = g_enum_get_value_by_nick(e, string));
+    if (ret) {
+	GST_DEBUG("%d %s %s", v->value, v->value_name, v->value_nick);
+	*image_type = (GstTagImageType) v->value;
+    }
+    g_type_class_unref(e);
+    return ret;
 }
 
-static GstFlowReturn
-gst_add_tag_mux_pad_sink_chain(
-    GstPad *		pad,
-    GstObject *		parent,
-    GstBuffer *		buffer)
+/// Create a sample for an image tag.
+/// What its header says about the image is added to its caps
+/// (width and height) and info (channels and progressive).
+static GstSample *
+gst_add_tag_mux_sample_new(
+    GstBuffer *		buffer,
+    GstCaps *		caps,
+    GstTagImageType	image_type)
 {
-    GST_TRACE_OBJECT(pad, ">");
+    GstStructure * info = NULL;
+    if (GST_TAG_IMAGE_TYPE_NONE != image_type) {
+	info = gst_structure_new("GstTagImageInfo",
+	    "image-type", GST_TYPE_TAG_IMAGE_TYPE, image_type,
+	    NULL);
+    }
+    GstAddTagMuxProbe probe;
+    GstMapInfo map;
+    gboolean probed = FALSE;
+    if (gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+	probed = gst_add_tag_mux_probe(map.data, map.size, &probe);
+	gst_buffer_unmap(buffer, &map);
+    }
+    if (!probed) {
+	return gst_sample_new(buffer, caps, NULL, info);
+    }
+    caps = gst_caps_copy(caps);
+    gst_caps_set_simple(caps,
+	"width", G_TYPE_INT, (gint) probe.width,
+	"height", G_TYPE_INT, (gint) probe.height,
+	NULL);
+    if (!info) {
+	info = gst_structure_new_empty("GstTagImageInfo");
+    }
+    gst_structure_set(info,
+	"channels", G_TYPE_UINT, probe.channels,
+	"progressive", G_TYPE_BOOLEAN, probe.progressive,
+	NULL);
+    GstSample * sample = gst_sample_new(buffer, caps, NULL, info);
+    gst_caps_unref(caps);
+    return sample;
+}
 
-    // guidance taken from
-    // gst-plugins-base/gst-libs/gst/tag/tags.c
-    // gst_tag_image_data_to_image_sample
+/// Replace a JPEG image with one that fits within our max-width x max-height
+static void
+gst_add_tag_mux_fit(
+    GstAddTagMux *	addtagmux,
+    GstBuffer **	buffer,
+    GstCaps **		caps)
+{
+    if (!addtagmux->max_width && !addtagmux->max_height) {
+	return;
+    }
+    gchar const * name
+	= gst_structure_get_name(gst_caps_get_structure(*caps, 0));
+    if (!g_str_equal(name, "image/jpeg")) {
+	return;
+    }
+    GstBuffer * scaled = gst_add_tag_mux_jpeg_scale(*buffer,
+	addtagmux->max_width, addtagmux->max_height);
+    if (scaled) {
+	GST_DEBUG_OBJECT(addtagmux, "scaled %" G_GSIZE_FORMAT
+	    " to %" G_GSIZE_FORMAT " bytes",
+	    gst_buffer_get_size(*buffer), gst_buffer_get_size(scaled));
+	gst_buffer_unref(*buffer);
+	*buffer = scaled;
+	// in case caps described the original's dimensions
+	gst_caps_unref(*caps);
+	*caps = gst_caps_new_empty_simple(name);
+    }
+}
 
-    GstCaps * caps
-        = gst_type_find_helper_for_buffer(GST_OBJECT(pad), buffer, NULL);
+/// Create a sample for an image tag from the content of a file.
+/// The file is mapped into memory, which the sample's buffer wraps
+/// (unless it is scaled).
+static GstSample *
+gst_add_tag_mux_sample_new_from_file(
+    GstAddTagMux *	addtagmux,
+    gchar const *	path,
+    GstTagImageType	image_type,
+    GError **		error)
+{
+    GST_TRACE_OBJECT(addtagmux, "> %s", path);
+    GMappedFile * file = g_mapped_file_new(path, FALSE, error);
+    if (!file) {
+	GST_TRACE_OBJECT(addtagmux, "< NULL");
+	return NULL;
+    }
+    gsize size = g_mapped_file_get_length(file);
+    // an empty file maps to no contents, which no buffer can wrap
+    if (!size) {
+	g_set_error(error, GST_STREAM_ERROR, GST_STREAM_ERROR_WRONG_TYPE,
+	    "%s is empty", path);
+	g_mapped_file_unref(file);
+	GST_TRACE_OBJECT(addtagmux, "< NULL");
+	return NULL;
+    }
+    GstBuffer * buffer = gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY,
+	g_mapped_file_get_contents(file), size, 0, size,
+	file, (GDestroyNotify) g_mapped_file_unref);
+    GstSample * sample = NULL;
+    GstCaps * caps = gst_type_find_helper_for_buffer(
+	GST_OBJECT(addtagmux), buffer, NULL);
+    if (caps && g_str_has_prefix(
+	    gst_structure_get_name(gst_caps_get_structure(caps, 0)), "image/")) {
+	// unless we select among images first
+	if (GST_ADD_TAG_MUX_SELECT_ALL == addtagmux->select) {
+	    gst_add_tag_mux_fit(addtagmux, &buffer, &caps);
+	}
+	sample = gst_add_tag_mux_sample_new(buffer, caps, image_type);
+    } else {
+	g_set_error(error, GST_STREAM_ERROR, GST_STREAM_ERROR_WRONG_TYPE,
+	    "%s is not an image", path);
+    }
     if (caps) {
-	GST_DEBUG_OBJECT(pad, "caps buffer %" GST_PTR_FORMAT, caps);
+	gst_caps_unref(caps);
+    }
+    gst_buffer_unref(buffer);
+    GST_TRACE_OBJECT(addtagmux, "< %p", sample);
+    return sample;
+}
 
-	gchar const * name
-	    = gst_structure_get_name(gst_caps_get_structure(caps, 0));
-	if (!g_str_has_prefix (name, "image/") &&
-		!g_str_equal (name, "text/uri-list")) {
-	    GST_WARNING_OBJECT(pad, "caps buffer not supported %"
-		GST_PTR_FORMAT, caps);
-	    gst_caps_unref(caps);
-	    gst_buffer_unref(buffer);
-	    GST_TRACE_OBJECT(pad, "< NOT SUPPORTED");
-	    return GST_FLOW_NOT_SUPPORTED;
+/// A fast hash of a block of memory.
+/// After xxHash64, a 64 bit word is taken into each of four independent
+/// lanes at a time, which the compiler can interleave (or vectorize).
+static guint64
+gst_add_tag_mux_hash(
+    guint8 const *	data,
+    gsize		size)
+{
+    guint64 const p1 = G_GUINT64_CONSTANT(0x9E3779B185EBCA87);
+    guint64 const p2 = G_GUINT64_CONSTANT(0xC2B2AE3D27D4EB4F);
+    guint64 lane[4] = {p1 + p2, p2, 0, -p1};
+    guint j;
+    gsize i;
+    for (i = 0; i + sizeof lane <= size; i += sizeof lane) {
+	for (j = 0; j < 4; ++j) {
+	    guint64 word;
+	    memcpy(&word, data + i + j * sizeof word, sizeof word);
+	    lane[j] += word * p2;
+	    lane[j] = (lane[j] << 31 | lane[j] >> 33) * p1;
 	}
+    }
+    guint64 hash = size;
+    for (j = 0; j < 4; ++j) {
+	hash = (hash ^ lane[j]) * p1 + p2;
+    }
+    for (; i < size; ++i) {
+	hash = (hash ^ data[i]) * p1;
+    }
+    hash ^= hash >> 33;
+    hash *= p2;
+    hash ^= hash >> 29;
+    return hash;
+}
 
-	GstTagImageType image_type = GST_TAG_IMAGE_TYPE_FRONT_COVER;
-	// change the default image_type from the current caps.
-	// this can be set with a capsfilter element with an image-type
-	// field whose string value can be converted (by name or nickname)
-	// to a GstTagImageType.
-	// For example, by inserting ...
-	//	image/jpeg,image-type=front-cover
-	// in the pipeline before us.
-	{
-	    GstCaps * c = gst_pad_get_current_caps(pad);
-	    GST_DEBUG_OBJECT(pad, "caps current %" GST_PTR_FORMAT, c);
-	    guint i = gst_caps_get_size(c);
-	    while (i--) {
-		gchar * n;
-		if (gst_structure_get(gst_caps_get_structure(c, i),
-			"image-type", G_TYPE_STRING, &n,
-			NULL)) {
-		    GEnumClass * e = g_type_class_ref(GST_TYPE_TAG_IMAGE_TYPE);
-		    GEnumValue * v;
-		    if (0
-			    || (v = g_enum_get_value_by_name(e, n))
-			    || (v = g_enum_get_value_by_nick(e, n))) {
-			GST_DEBUG_OBJECT(pad, "%d %s %s", v->value,
-			    v->value_name, v->value_nick);
-			image_type = (GstTagImageType) v->value;
-		    }
-		    g_type_class_unref(e);
-		    g_free(n);
-		}
+/// The image-type of an image sample
+static GstTagImageType
+gst_add_tag_mux_sample_image_type(
+    GstSample *		sample)
+{
+    GstStructure const * info = gst_sample_get_info(sample);
+    gint image_type = GST_TAG_IMAGE_TYPE_NONE;
+    if (info) {
+	gst_structure_get_enum(info, "image-type", GST_TYPE_TAG_IMAGE_TYPE,
+	    &image_type);
+    }
+    return (GstTagImageType) image_type;
+}
+
+/// Remove each image tag with the same content and image-type
+/// as one before it.
+/// Content is compared by hash and then, only if they are the same, by byte.
+static void
+gst_add_tag_mux_dedupe(
+    GstObject *		object,
+    GstTagList *	taglist)
+{
+    guint n = gst_tag_list_get_tag_size(taglist, GST_TAG_IMAGE);
+    if (n < 2) {
+	return;
+    }
+    GST_TRACE_OBJECT(object, "> %u", n);
+    GstSample ** samples = g_new0(GstSample *, n);
+    guint64 * hashes = g_new0(guint64, n);
+    guint kept = 0;
+    guint i;
+    for (i = 0; i < n; ++i) {
+	GstSample * sample;
+	if (!gst_tag_list_get_sample_index(taglist, GST_TAG_IMAGE, i,
+		&sample)) {
+	    continue;
+	}
+	GstBuffer * buffer = gst_sample_get_buffer(sample);
+	GstMapInfo map;
+	if (!buffer || !gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+	    samples[kept++] = sample;	// unique
+	    continue;
+	}
+	guint64 hash = gst_add_tag_mux_hash(map.data, map.size);
+	GstTagImageType image_type = gst_add_tag_mux_sample_image_type(sample);
+	gboolean same = FALSE;
+	guint k;
+	for (k = 0; k < kept && !same; ++k) {
+	    GstBuffer * b = gst_sample_get_buffer(samples[k]);
+	    GstMapInfo m;
+	    if (hashes[k] != hash || !b || gst_buffer_get_size(b) != map.size
+		    || gst_add_tag_mux_sample_image_type(samples[k])
+			!= image_type
+		    || !gst_buffer_map(b, &m, GST_MAP_READ)) {
+		continue;
 	    }
-	    gst_caps_unref(c);
+	    same = !memcmp(m.data, map.data, map.size);
+	    gst_buffer_unmap(b, &m);
 	}
-
-	// create sample for image tag
-	GstStructure * info = NULL;
-	if (GST_TAG_IMAGE_TYPE_NONE != image_type) {
-	    info = gst_structure_new("GstTagImageInfo",
-		"image-type", GST_TYPE_TAG_IMAGE_TYPE, image_type,
+	gst_buffer_unmap(buffer, &map);
+	if (same) {
+	    GST_DEBUG_OBJECT(object, "dedupe %u %016" G_GINT64_MODIFIER "x",
+		i, hash);
+	    gst_sample_unref(sample);
+	} else {
+	    hashes[kept] = hash;
+	    samples[kept++] = sample;
+	}
+    }
+    if (kept < n) {
+	gst_tag_list_remove_tag(taglist, GST_TAG_IMAGE);
+	for (i = 0; i < kept; ++i) {
+	    gst_tag_list_add(taglist, GST_TAG_MERGE_APPEND,
+		GST_TAG_IMAGE, samples[i],
 		NULL);
 	}
-	GstSample * sample = gst_sample_new(buffer, caps, NULL, info);
-	gst_caps_unref(caps);
+    }
+    for (i = 0; i < kept; ++i) {
+	gst_sample_unref(samples[i]);
+    }
+    g_free(hashes);
+    g_free(samples);
+    GST_TRACE_OBJECT(object, "< %u", kept);
+}
 
-	// append image tag with sample to our element's list
-	GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(parent);
-	g_mutex_lock(&addtagmux->mutex);
-	gst_tag_list_add(addtagmux->taglist, GST_TAG_MERGE_APPEND,
+/// The size of an image from its caps and whether it fits
+/// within our max-width x max-height
+static gboolean
+gst_add_tag_mux_sample_fits(
+    GstAddTagMux *	addtagmux,
+    GstSample *		sample,
+    guint64 *		area)
+{
+    GstCaps * caps = gst_sample_get_caps(sample);
+    gint width = 0;
+    gint height = 0;
+    if (caps) {
+	GstStructure * structure = gst_caps_get_structure(caps, 0);
+	gst_structure_get_int(structure, "width", &width);
+	gst_structure_get_int(structure, "height", &height);
+    }
+    *area = (guint64) width * height;
+    return *area
+	&& !(addtagmux->max_width && (guint) width > addtagmux->max_width)
+	&& !(addtagmux->max_height && (guint) height > addtagmux->max_height);
+}
+
+/// Keep only one image tag of each image-type, by our select policy,
+/// and scale those that we keep to fit.
+/// Only the probed header of each image is looked at to select it,
+/// so those we drop are never decoded.
+static void
+gst_add_tag_mux_select(
+    GstAddTagMux *	addtagmux,
+    GstTagList *	taglist)
+{
+    guint n = gst_tag_list_get_tag_size(taglist, GST_TAG_IMAGE);
+    if (!n) {
+	return;
+    }
+    GST_TRACE_OBJECT(addtagmux, "> %u", n);
+    GstSample ** samples = g_new0(GstSample *, n);
+    gint * best = g_new(gint, n);	// for the first of an image-type
+    guint i;
+    for (i = 0; i < n; ++i) {
+	best[i] = -1;
+	if (!gst_tag_list_get_sample_index(taglist, GST_TAG_IMAGE, i,
+		&samples[i])) {
+	    continue;
+	}
+	GstTagImageType image_type
+	    = gst_add_tag_mux_sample_image_type(samples[i]);
+	guint first;
+	for (first = 0; first < i; ++first) {
+	    if (0 <= best[first] && image_type
+		    == gst_add_tag_mux_sample_image_type(samples[first])) {
+		break;
+	    }
+	}
+	if (first == i) {
+	    best[i] = i;
+	    continue;
+	}
+	guint64 area, best_area;
+	gboolean fits = gst_add_tag_mux_sample_fits(addtagmux,
+	    samples[i], &area);
+	gboolean best_fits = gst_add_tag_mux_sample_fits(addtagmux,
+	    samples[best[first]], &best_area);
+	gboolean better;
+	if (GST_ADD_TAG_MUX_SELECT_FIRST_FIT == addtagmux->select) {
+	    better = fits && !best_fits;
+	} else if (fits) {
+	    better = !best_fits || area > best_area;
+	} else {
+	    better = !best_fits && area && (!best_area || area < best_area);
+	}
+	if (better) {
+	    best[first] = i;
+	}
+    }
+
+    // keep the best of each image-type, scaled to fit
+    gst_tag_list_remove_tag(taglist, GST_TAG_IMAGE);
+    for (i = 0; i < n; ++i) {
+	if (0 > best[i]) {
+	    continue;
+	}
+	GstSample * sample = samples[best[i]];
+	GST_DEBUG_OBJECT(addtagmux, "select %d", best[i]);
+	GstBuffer * buffer = gst_buffer_ref(gst_sample_get_buffer(sample));
+	GstCaps * caps = gst_caps_ref(gst_sample_get_caps(sample));
+	GstBuffer * original = buffer;
+	gst_add_tag_mux_fit(addtagmux, &buffer, &caps);
+	if (buffer != original) {
+	    sample = gst_add_tag_mux_sample_new(buffer, caps,
+		gst_add_tag_mux_sample_image_type(sample));
+	} else {
+	    gst_sample_ref(sample);
+	}
+	gst_buffer_unref(buffer);
+	gst_caps_unref(caps);
+	gst_tag_list_add(taglist, GST_TAG_MERGE_APPEND,
 	    GST_TAG_IMAGE, sample,
 	    NULL);
-	g_mutex_unlock(&addtagmux->mutex);
 	gst_sample_unref(sample);
     }
-    gst_buffer_unref(buffer);
-
-    GST_TRACE_OBJECT(pad, "< OK");
-    return GST_FLOW_OK;
+    for (i = 0; i < n; ++i) {
+	if (samples[i]) {
+	    gst_sample_unref(samples[i]);
+	}
+    }
+    g_free(best);
+    g_free(samples);
+    GST_TRACE_OBJECT(addtagmux, "<");
 }
 
-static GstPadLinkReturn gst_add_tag_mux_pad_link(
-    GstPad *		pad,
-    GstObject *		parent,
-    GstPad *		peer)
+/// Replace image tags with METADATA_BLOCK_PICTURE comments.
+/// Each is cached by the content and image-type of its image
+/// so that it is encoded only once.
+/// An image that we cannot make a comment of is kept as it is.
+static void
+gst_add_tag_mux_picture_comments(
+    GstAddTagMux *	addtagmux,
+    GstTagList *	taglist)
 {
-    GST_TRACE_OBJECT(pad, ">");
-    // gst_pad_set_chain*_function insists on the pad's direction property
-    // being GST_PAD_SINK
-    gst_pad_set_chain_function(pad,
-	GST_DEBUG_FUNCPTR(gst_add_tag_mux_pad_sink_chain));
-    GST_TRACE_OBJECT(pad, "< OK");
-    return GST_PAD_LINK_OK;
+    guint i, n = gst_tag_list_get_tag_size(taglist, GST_TAG_IMAGE);
+    if (!n) {
+	return;
+    }
+    GPtrArray * kept = g_ptr_array_new_with_free_func(
+	(GDestroyNotify) gst_sample_unref);
+    for (i = 0; i < n; ++i) {
+	GstSample * sample;
+	if (!gst_tag_list_get_sample_index(taglist, GST_TAG_IMAGE, i, &sample)) {
+	    continue;
+	}
+	GstBuffer * buffer = gst_sample_get_buffer(sample);
+	GstCaps * caps = gst_sample_get_caps(sample);
+	GstMapInfo map;
+	if (buffer && caps && gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+	    GstStructure const * structure = gst_caps_get_structure(caps, 0);
+	    gchar const * mime = gst_structure_get_name(structure);
+	    GstTagImageType image_type
+		= gst_add_tag_mux_sample_image_type(sample);
+	    gchar * key = g_strdup_printf("picture %" G_GINT64_MODIFIER "x"
+		" %" G_GSIZE_FORMAT " %d %s",
+		gst_add_tag_mux_hash(map.data, map.size), map.size,
+		image_type, mime);
+	    gchar * comment = NULL;
+	    GPtrArray * cached = gst_add_tag_mux_cache_lookup(key);
+	    if (cached) {
+		GstBuffer * b = gst_sample_get_buffer(
+		    g_ptr_array_index(cached, 0));
+		GstMapInfo m;
+		if (gst_buffer_map(b, &m, GST_MAP_READ)) {
+		    comment = g_strndup((gchar const *) m.data, m.size);
+		    gst_buffer_unmap(b, &m);
+		}
+		g_ptr_array_unref(cached);
+	    }
+	    gboolean encoded = !comment;
+	    if (encoded) {
+		gint width = 0;
+		gint height = 0;
+		gst_structure_get_int(structure, "width", &width);
+		gst_structure_get_int(structure, "height", &height);
+		comment = gst_add_tag_mux_picture_comment(map.data, map.size,
+		    mime, image_type, width, height);
+		if (comment && gst_add_tag_mux_cache_get_max_bytes()) {
+		    gsize length = strlen(comment);
+		    GPtrArray * samples = g_ptr_array_new_with_free_func(
+			(GDestroyNotify) gst_sample_unref);
+		    g_ptr_array_add(samples, gst_sample_new(
+			gst_buffer_new_wrapped(g_strndup(comment, length),
+			    length),
+			NULL, NULL, NULL));
+		    gst_add_tag_mux_cache_insert(key, samples);
+		    g_ptr_array_unref(samples);
+		}
+	    }
+	    GST_DEBUG_OBJECT(addtagmux, "%s %s", key,
+		!comment ? "too big" : encoded ? "encoded" : "cached");
+	    gboolean made = NULL != comment;
+	    if (made) {
+		gst_tag_list_add(taglist, GST_TAG_MERGE_APPEND,
+		    GST_TAG_EXTENDED_COMMENT, comment,
+		    NULL);
+		g_free(comment);
+	    }
+	    g_free(key);
+	    gst_buffer_unmap(buffer, &map);
+	    if (made) {
+		gst_sample_unref(sample);
+		continue;
+	    }
+	}
+	g_ptr_array_add(kept, sample);
+    }
+    gst_tag_list_remove_tag(taglist, GST_TAG_IMAGE);
+    for (i = 0; i < kept->len; ++i) {
+	gst_tag_list_add(taglist, GST_TAG_MERGE_APPEND,
+	    GST_TAG_IMAGE, g_ptr_array_index(kept, i),
+	    NULL);
+    }
+    g_ptr_array_unref(kept);
 }
 
-static gboolean gst_add_tag_mux_pad_sink_event(
-    GstPad *		pad,
-    GstObject *		parent,
-    GstEvent *		event)
+/// Finish a taglist before it is pushed.
+/// This may decode, scale and encode images
+/// so it is called without our locks, on a taglist no one else can see.
+static void
+gst_add_tag_mux_finish_tags(
+    GstAddTagMux *	addtagmux,
+    GstTagList *	taglist)
 {
-    GST_TRACE_OBJECT(pad, ">");
-    switch (GST_EVENT_TYPE(event)) {
-	case GST_EVENT_EOS: {
-	    gst_pad_set_chain_function(pad,
-		GST_DEBUG_FUNCPTR(gst_add_tag_mux_pad_sink_chain_eos));
-	    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(parent);
-	    g_mutex_lock(&addtagmux->mutex);
-	    --addtagmux->count;
-	    GST_DEBUG_OBJECT(pad, "EOS %d", addtagmux->count);
-	    if (!addtagmux->count) {
-		g_cond_signal(&addtagmux->cond);
-	    }
-	    g_mutex_unlock(&addtagmux->mutex);
-	    break;
-	}
-	default:
-	    break;
+    if (addtagmux->dedupe) {
+	gst_add_tag_mux_dedupe(GST_OBJECT(addtagmux), taglist);
+    }
+    if (GST_ADD_TAG_MUX_SELECT_ALL != addtagmux->select) {
+	gst_add_tag_mux_select(addtagmux, taglist);
+    }
+    if (addtagmux->picture_comments) {
+	gst_add_tag_mux_picture_comments(addtagmux, taglist);
     }
-    GST_TRACE_OBJECT(pad, "< TRUE");
-    return TRUE;
 }
 
+/// Wait while our taglist is being finished (without the mutex)
+/// so that it is not seen, or changed, until it is.
+/// Called with the mutex held.
 static void
-gst_add_tag_mux_pad_init(
-    GstAddTagMuxPad *	addtagmuxpad)
+gst_add_tag_mux_finishing_wait(
+    GstAddTagMux *	addtagmux)
 {
-    GST_TRACE_OBJECT(addtagmuxpad, ">");
-    GstPad * pad = GST_PAD(addtagmuxpad);
+    while (addtagmux->finishing) {
+	g_cond_wait(&addtagmux->cond, &addtagmux->mutex);
+    }
+}
 
-    GST_OBJECT_FLAG_SET(pad, GST_PAD_FLAG_NEED_PARENT);
-    gst_pad_set_link_function(pad,
-	GST_DEBUG_FUNCPTR(gst_add_tag_mux_pad_link));
-    gst_pad_set_event_function(pad,
-	GST_DEBUG_FUNCPTR(gst_add_tag_mux_pad_sink_event));
+/// Add the tags of a late additional stream to ours
+/// and to those of each main stream that took ours already,
+/// to push again.
+/// Each is copied under the mutex, finished without it and published
+/// under it again; meanwhile, others wait for us (finishing).
+/// Called with the mutex held.
+static void
+gst_add_tag_mux_late_tags(
+    GstAddTagMuxPad *	addtagmuxpad,
+    GstAddTagMux *	addtagmux)
+{
+    gst_add_tag_mux_finishing_wait(addtagmux);
+    addtagmux->finishing = TRUE;
+    GstTagList * late = gst_tag_list_ref(addtagmuxpad->taglist);
+    GstTagList * taglist = addtagmux->taglist
+	? gst_tag_list_copy(addtagmux->taglist)
+	: gst_tag_list_new_empty();
+    gst_tag_list_insert(taglist, late, GST_TAG_MERGE_APPEND);
+    GList * pairs = NULL;	// that took ours already
+    GList * taglists = NULL;	// for each of them
+    GList * link;
+    for (link = addtagmux->pairs; link; link = link->next) {
+	GstAddTagMuxPair * pair = link->data;
+	if (!pair->released) {
+	    continue;
+	}
+	GstTagList * t = pair->taglist
+	    ? gst_tag_list_copy(pair->taglist)
+	    : gst_tag_list_new_empty();
+	gst_tag_list_insert(t, late, GST_TAG_MERGE_APPEND);
+	pairs = g_list_prepend(pairs, pair);
+	taglists = g_list_prepend(taglists, t);
+    }
+    g_mutex_unlock(&addtagmux->mutex);
 
-    GST_TRACE_OBJECT(addtagmuxpad, "<");
-}
+    gst_add_tag_mux_finish_tags(addtagmux, taglist);
+    for (link = taglists; link; link = link->next) {
+	gst_add_tag_mux_finish_tags(addtagmux, link->data);
+    }
 
-// define gst_add_tag_mux class as a subclass of gst_element.
-// defines static variable gst_add_tag_mux_parent_class
-G_DEFINE_TYPE_WITH_CODE (
+    g_mutex_lock(&addtagmux->mutex);
+    if (addtagmux->taglist) {
+	gst_tag_list_unref(addtagmux->taglist);
+    }
+    addtagmux->taglist = taglist;
+    GList * t;
+    for (link = pairs, t = taglists; link; link = link->next, t = t->next) {
+	GstAddTagMuxPair * pair = link->data;
+	// unless it was released meanwhile
+	if (!g_list_find(addtagmux->pairs, pair)) {
+	    gst_tag_list_unref(t->data);
+	    continue;
+	}
+	if (pair->taglist) {
+	    gst_tag_list_unref(pair->taglist);
+	}
+	pair->taglist = t->data;
+	g_atomic_int_set(&pair->late, TRUE);
+    }
+    g_list_free(taglists);
+    g_list_free(pairs);
+    gst_tag_list_unref(late);
+    addtagmux->finishing = FALSE;
+    g_cond_broadcast(&addtagmux->cond);
+}
+
+/// An additional stream is no longer pending.
+/// Signal the main stream when none are.
+/// Called with the mutex held.
+static void
+gst_add_tag_mux_pad_settle(
+    GstAddTagMuxPad *	addtagmuxpad,
+    GstAddTagMux *	addtagmux)
+{
+    if (addtagmuxpad->pending) {
+	addtagmuxpad->pending = FALSE;
+	--addtagmux->count;
+	if (addtagmuxpad->required) {
+	    --addtagmux->required;
+	}
+	GST_DEBUG_OBJECT(addtagmuxpad, "settle %d %d",
+	    addtagmux->count, addtagmux->required);
+	if (!addtagmux->count || !addtagmux->required) {
+	    g_cond_broadcast(&addtagmux->cond);
+	}
+    }
+}
+
+/// Give back what we held, from a pad or released pads, to our budgets.
+/// Called with the mutex held.
+static void
+gst_add_tag_mux_discharge(
+    GstAddTagMux *	addtagmux,
+    guint64		bytes)
+{
+    if (!bytes) {
+	return;
+    }
+    addtagmux->held_bytes -= bytes;
+    g_mutex_lock(&budget.mutex);
+    budget.bytes -= bytes;
+    g_mutex_unlock(&budget.mutex);
+}
+
+/// Called with the mutex held
+static void
+gst_add_tag_mux_pad_discharge(
+    GstAddTagMuxPad *	addtagmuxpad,
+    GstAddTagMux *	addtagmux)
+{
+    gst_add_tag_mux_discharge(addtagmux, addtagmuxpad->held_bytes);
+    addtagmuxpad->held_bytes = 0;
+}
+
+/// Let go of what a dropped stream made.
+/// Until it settles, only its own streaming thread writes its taglist
+/// (and charges for it), so only that thread does this:
+/// after each buffer and event, including the first after another
+/// marked it dropped.
+/// Called with the mutex held.
+static void
+gst_add_tag_mux_pad_discard(
+    GstAddTagMuxPad *	addtagmuxpad,
+    GstAddTagMux *	addtagmux)
+{
+    if (!addtagmuxpad->dropped) {
+	return;
+    }
+    if (addtagmuxpad->taglist) {
+	gst_tag_list_unref(addtagmuxpad->taglist);
+	addtagmuxpad->taglist = NULL;
+    }
+    gst_add_tag_mux_pad_discharge(addtagmuxpad, addtagmux);
+}
+
+static GstFlowReturn
+gst_add_tag_mux_pad_sink_chain_eos(
+    GstPad *		pad,
+    GstObject *		parent,
+    GstBuffer *		buffer)
+{
+    GST_TRACE_OBJECT(pad, ">");
+    GST_WARNING_OBJECT(pad, "EOS");
+    gst_buffer_unref(buffer);
+    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(parent);
+    g_mutex_lock(&addtagmux->mutex);
+    gst_add_tag_mux_pad_discard(GST_ADD_TAG_MUX_PAD(pad), addtagmux);
+    g_mutex_unlock(&addtagmux->mutex);
+    GST_TRACE_OBJECT(pad, "< EOS");
+    return GST_FLOW_EOS;
+}
+
+/// An additional stream will no longer come.
+/// It is no longer pending and what it made is dropped,
+/// by its own streaming thread (see above).
+/// Called with the mutex held.
+static void
+gst_add_tag_mux_pad_drop(
+    GstAddTagMuxPad *	addtagmuxpad,
+    GstAddTagMux *	addtagmux)
+{
+    if (addtagmuxpad->pending) {
+	GST_DEBUG_OBJECT(addtagmuxpad, "drop");
+	addtagmuxpad->dropped = TRUE;
+	gst_pad_set_chain_function(GST_PAD(addtagmuxpad),
+	    GST_DEBUG_FUNCPTR(gst_add_tag_mux_pad_sink_chain_eos));
+	gst_add_tag_mux_pad_settle(addtagmuxpad, addtagmux);
+    }
+}
+
+/// Charge an image to a pad's (if any), our and the process budget
+/// if it is within all of them.
+/// Without a pad (an image from a file of ours) it is held by us
+/// until we are reset.
+/// Called with the mutex held.
+static gboolean
+gst_add_tag_mux_pad_charge(
+    GstAddTagMuxPad *	addtagmuxpad,
+    GstAddTagMux *	addtagmux,
+    gsize		bytes)
+{
+    if ((addtagmuxpad && addtagmuxpad->max_bytes
+		&& addtagmuxpad->held_bytes + bytes > addtagmuxpad->max_bytes)
+	    || (addtagmux->max_bytes
+		&& addtagmux->held_bytes + bytes > addtagmux->max_bytes)) {
+	return FALSE;
+    }
+    g_mutex_lock(&budget.mutex);
+    gboolean ret = !budget.max_bytes
+	|| budget.bytes + bytes <= budget.max_bytes;
+    if (ret) {
+	budget.bytes += bytes;
+    }
+    g_mutex_unlock(&budget.mutex);
+    if (ret) {
+	if (addtagmuxpad) {
+	    addtagmuxpad->held_bytes += bytes;
+	}
+	addtagmux->held_bytes += bytes;
+    }
+    return ret;
+}
+
+/// Charge the image in a buffer to our budgets (see above)
+/// or, when it is beyond them, do as over-budget says:
+/// drop it (set buffer to NULL), replace it with a smaller one
+/// or post an error (and drop the pad, if any, so it is not waited for).
+static GstFlowReturn
+gst_add_tag_mux_pad_budget(
+    GstAddTagMuxPad *	addtagmuxpad,
+    GstAddTagMux *	addtagmux,
+    GstBuffer **	buffer,
+    GstCaps **		caps)
+{
+    GstObject * object = addtagmuxpad
+	? GST_OBJECT(addtagmuxpad)
+	: GST_OBJECT(addtagmux);
+    gsize size = gst_buffer_get_size(*buffer);
+    g_mutex_lock(&addtagmux->mutex);
+    gboolean charged = gst_add_tag_mux_pad_charge(addtagmuxpad, addtagmux,
+	size);
+    GstAddTagMuxOverBudget over_budget = addtagmux->over_budget;
+    if (!charged) {
+	++addtagmux->over_budget_images;
+    }
+    g_mutex_unlock(&addtagmux->mutex);
+    if (charged) {
+	return GST_FLOW_OK;
+    }
+    GST_WARNING_OBJECT(object, "image of %" G_GSIZE_FORMAT
+	" bytes over budget", size);
+    // what is made of this stream now depends on load; do not cache it
+    if (addtagmuxpad && addtagmuxpad->cache_key) {
+	g_free(addtagmuxpad->cache_key);
+	addtagmuxpad->cache_key = NULL;
+	g_ptr_array_unref(addtagmuxpad->samples);
+	addtagmuxpad->samples = NULL;
+    }
+    if (GST_ADD_TAG_MUX_OVER_BUDGET_ERROR == over_budget) {
+	GST_ELEMENT_ERROR(addtagmux, RESOURCE, NO_SPACE_LEFT,
+	    ("image over budget"),
+	    ("%s: %" G_GSIZE_FORMAT " bytes", GST_OBJECT_NAME(object), size));
+	gst_buffer_unref(*buffer);
+	*buffer = NULL;
+	if (addtagmuxpad) {
+	    g_mutex_lock(&addtagmux->mutex);
+	    gst_add_tag_mux_pad_drop(addtagmuxpad, addtagmux);
+	    g_mutex_unlock(&addtagmux->mutex);
+	}
+	return GST_FLOW_ERROR;
+    }
+    gchar const * name
+	= gst_structure_get_name(gst_caps_get_structure(*caps, 0));
+    if (GST_ADD_TAG_MUX_OVER_BUDGET_SCALE == over_budget
+	    && g_str_equal(name, "image/jpeg")) {
+	GstBuffer * scaled = gst_add_tag_mux_jpeg_scale(*buffer,
+	    OVER_BUDGET_SCALE_SIZE, OVER_BUDGET_SCALE_SIZE);
+	if (scaled) {
+	    g_mutex_lock(&addtagmux->mutex);
+	    charged = gst_add_tag_mux_pad_charge(addtagmuxpad, addtagmux,
+		gst_buffer_get_size(scaled));
+	    g_mutex_unlock(&addtagmux->mutex);
+	    if (charged) {
+		GST_DEBUG_OBJECT(object, "scaled to %" G_GSIZE_FORMAT " bytes",
+		    gst_buffer_get_size(scaled));
+		gst_buffer_unref(*buffer);
+		*buffer = scaled;
+		gst_caps_unref(*caps);
+		*caps = gst_caps_new_empty_simple("image/jpeg");
+		return GST_FLOW_OK;
+	    }
+	    gst_buffer_unref(scaled);
+	}
+    }
+    gst_buffer_unref(*buffer);
+    *buffer = NULL;
+    return GST_FLOW_OK;
+}
+
+/// Add an image sample to those of a pad
+static void
+gst_add_tag_mux_pad_add_sample(
+    GstAddTagMuxPad *	addtagmuxpad,
+    GstSample *		sample)
+{
+    // remember sample for cache
+    if (addtagmuxpad->samples) {
+	g_ptr_array_add(addtagmuxpad->samples, gst_sample_ref(sample));
+    }
+
+    // append image tag with sample to our pad's list.
+    // only this streaming thread touches it until it is merged
+    // with the others when the main stream is released
+    if (!addtagmuxpad->taglist) {
+	addtagmuxpad->taglist = gst_tag_list_new_empty();
+    }
+    gst_tag_list_add(addtagmuxpad->taglist, GST_TAG_MERGE_APPEND,
+	GST_TAG_IMAGE, sample,
+	NULL);
+}
+
+/// A file named by a text/uri-list, to be made into an image sample
+/// on our pool
+typedef struct {
+    GstAddTagMuxPad *	addtagmuxpad;	// referenced
+    GstAddTagMux *	addtagmux;	// referenced
+    guint		index;		// into resolved
+    gchar *		path;
+    GstTagImageType	image_type;
+} Resolve;
+
+static void
+gst_add_tag_mux_resolve(
+    gpointer		data,
+    gpointer		user_data)
+{
+    Resolve * resolve = data;
+    GstAddTagMuxPad * addtagmuxpad = resolve->addtagmuxpad;
+    GstAddTagMux * addtagmux = resolve->addtagmux;
+    GST_TRACE_OBJECT(addtagmuxpad, "> %s", resolve->path);
+    GError * error = NULL;
+    GstSample * sample = gst_add_tag_mux_sample_new_from_file(addtagmux,
+	resolve->path, resolve->image_type, &error);
+    if (!sample) {
+	GST_WARNING_OBJECT(addtagmuxpad, "%s", error->message);
+	g_error_free(error);
+    }
+    g_mutex_lock(&addtagmux->mutex);
+    g_ptr_array_index(addtagmuxpad->resolved, resolve->index) = sample;
+    if (!--addtagmuxpad->resolving) {
+	g_cond_broadcast(&addtagmuxpad->resolve_cond);
+    }
+    g_mutex_unlock(&addtagmux->mutex);
+    GST_TRACE_OBJECT(addtagmuxpad, "<");
+    gst_object_unref(addtagmuxpad);
+    gst_object_unref(addtagmux);
+    g_free(resolve->path);
+    g_slice_free(Resolve, resolve);
+}
+
+/// Resolve each local file of a text/uri-list, in parallel,
+/// on a pool shared by all addtagmux elements
+static void
+gst_add_tag_mux_pad_resolve(
+    GstAddTagMuxPad *	addtagmuxpad,
+    GstAddTagMux *	addtagmux,
+    GstBuffer *		buffer)
+{
+    static GThreadPool * pool = NULL;
+    if (g_once_init_enter(&pool)) {
+	g_once_init_leave(&pool, g_thread_pool_new(gst_add_tag_mux_resolve,
+	    NULL, g_get_num_processors(), FALSE, NULL));
+    }
+    GstMapInfo map;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+	return;
+    }
+    gchar * text = g_strndup((gchar const *) map.data, map.size);
+    gst_buffer_unmap(buffer, &map);
+    gchar ** uris = g_uri_list_extract_uris(text);
+    g_free(text);
+    gchar ** uri;
+    for (uri = uris; *uri; ++uri) {
+	gchar * path = g_filename_from_uri(*uri, NULL, NULL);
+	if (!path) {
+	    GST_WARNING_OBJECT(addtagmuxpad, "not a local file %s", *uri);
+	    continue;
+	}
+	Resolve * resolve = g_slice_new(Resolve);
+	resolve->addtagmuxpad = gst_object_ref(addtagmuxpad);
+	resolve->addtagmux = gst_object_ref(addtagmux);
+	resolve->path = path;
+	resolve->image_type = addtagmuxpad->image_type;
+	g_mutex_lock(&addtagmux->mutex);
+	if (!addtagmuxpad->resolved) {
+	    addtagmuxpad->resolved = g_ptr_array_new();
+	}
+	resolve->index = addtagmuxpad->resolved->len;
+	g_ptr_array_add(addtagmuxpad->resolved, NULL);
+	++addtagmuxpad->resolving;
+	g_mutex_unlock(&addtagmux->mutex);
+	g_thread_pool_push(pool, resolve, NULL);
+    }
+    g_strfreev(uris);
+}
+
+/// Wait for what is being resolved for a pad and take it.
+/// Called with the mutex held.
+static GPtrArray *
+gst_add_tag_mux_pad_take_resolved(
+    GstAddTagMuxPad *	addtagmuxpad,
+    GstAddTagMux *	addtagmux)
+{
+    while (addtagmuxpad->resolving) {
+	g_cond_wait(&addtagmuxpad->resolve_cond, &addtagmux->mutex);
+    }
+    GPtrArray * resolved = addtagmuxpad->resolved;
+    addtagmuxpad->resolved = NULL;
+    return resolved;
+}
+
+/// Add, in order, the images resolved or cached for a pad
+/// (within our budget)
+static void
+gst_add_tag_mux_pad_add_resolved(
+    GstAddTagMuxPad *	addtagmuxpad,
+    GstAddTagMux *	addtagmux,
+    GPtrArray *		resolved)
+{
+    guint i;
+    for (i = 0; i < resolved->len; ++i) {
+	GstSample * sample = g_ptr_array_index(resolved, i);
+	if (!sample) {
+	    continue;
+	}
+	GstBuffer * buffer = gst_buffer_ref(gst_sample_get_buffer(sample));
+	GstCaps * caps = gst_caps_ref(gst_sample_get_caps(sample));
+	GstFlowReturn ret = gst_add_tag_mux_pad_budget(addtagmuxpad, addtagmux,
+	    &buffer, &caps);
+	if (buffer) {
+	    if (buffer == gst_sample_get_buffer(sample)) {
+		gst_add_tag_mux_pad_add_sample(addtagmuxpad, sample);
+	    } else {
+		GstSample * scaled = gst_add_tag_mux_sample_new(buffer, caps,
+		    gst_add_tag_mux_sample_image_type(sample));
+		gst_add_tag_mux_pad_add_sample(addtagmuxpad, scaled);
+		gst_sample_unref(scaled);
+	    }
+	    gst_buffer_unref(buffer);
+	}
+	gst_caps_unref(caps);
+	if (GST_FLOW_OK != ret) {
+	    break;
+	}
+    }
+}
+
+/// Return the key of the image in a buffer in the disk cache
+/// (its content and how we would scale it)
+/// or NULL if it is not cached there (it is not one we would scale).
+static gchar *
+gst_add_tag_mux_pad_disk_key(
+    GstAddTagMuxPad *	addtagmuxpad,
+    GstAddTagMux *	addtagmux,
+    GstBuffer *		buffer,
+    GstCaps *		caps)
+{
+    if (GST_ADD_TAG_MUX_SELECT_ALL != addtagmux->select
+	    || (!addtagmux->max_width && !addtagmux->max_height)
+	    || !gst_add_tag_mux_disk_enabled()) {
+	return NULL;
+    }
+    gchar const * name
+	= gst_structure_get_name(gst_caps_get_structure(caps, 0));
+    GstMapInfo map;
+    if (!g_str_equal(name, "image/jpeg")
+	    || !gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+	return NULL;
+    }
+    gchar * key = g_strdup_printf("scale %016" G_GINT64_MODIFIER "x"
+	" %" G_GSIZE_FORMAT " %s %ux%u %d",
+	gst_add_tag_mux_hash(map.data, map.size), map.size, name,
+	addtagmux->max_width, addtagmux->max_height,
+	addtagmuxpad->image_type);
+    gst_buffer_unmap(buffer, &map);
+    return key;
+}
+
+/// Add an image tag for what is in a buffer
+static GstFlowReturn
+gst_add_tag_mux_pad_add_buffer(
+    GstAddTagMuxPad *	addtagmuxpad,
+    GstAddTagMux *	addtagmux,
+    GstBuffer *		buffer)
+{
+    GstPad * pad = GST_PAD(addtagmuxpad);
+    GST_TRACE_OBJECT(pad, ">");
+
+    // guidance taken from
+    // gst-plugins-base/gst-libs/gst/tag/tags.c
+    // gst_tag_image_data_to_image_sample
+
+    // trust caps negotiated for the pad, if we can, otherwise typefind
+    GstCaps * caps;
+    if (addtagmuxpad->caps) {
+	caps = gst_caps_ref(addtagmuxpad->caps);
+    } else {
+	gint64 start = g_get_monotonic_time();
+	caps = gst_type_find_helper_for_buffer(GST_OBJECT(pad), buffer, NULL);
+	addtagmuxpad->typefind_time
+	    += (g_get_monotonic_time() - start) * GST_USECOND;
+    }
+    if (caps) {
+	GST_DEBUG_OBJECT(pad, "caps buffer %" GST_PTR_FORMAT, caps);
+
+	gchar const * name
+	    = gst_structure_get_name(gst_caps_get_structure(caps, 0));
+	if (!g_str_has_prefix (name, "image/") &&
+		!g_str_equal (name, "text/uri-list")) {
+	    GST_WARNING_OBJECT(pad, "caps buffer not supported %"
+		GST_PTR_FORMAT, caps);
+	    gst_caps_unref(caps);
+	    gst_buffer_unref(buffer);
+	    // upstream will error out without EOS
+	    g_mutex_lock(&addtagmux->mutex);
+	    gst_add_tag_mux_pad_drop(addtagmuxpad, addtagmux);
+	    g_mutex_unlock(&addtagmux->mutex);
+	    GST_TRACE_OBJECT(pad, "< NOT SUPPORTED");
+	    return GST_FLOW_NOT_SUPPORTED;
+	}
+
+	// files of a uri-list are made into images on our pool
+	if (addtagmux->resolve_uris && g_str_equal(name, "text/uri-list")) {
+	    gst_add_tag_mux_pad_resolve(addtagmuxpad, addtagmux, buffer);
+	    gst_caps_unref(caps);
+	    gst_buffer_unref(buffer);
+	    GST_TRACE_OBJECT(pad, "< OK");
+	    return GST_FLOW_OK;
+	}
+
+	// what we make (or made before, maybe in another process)
+	// of the image, before any budget
+	GstSample * made = NULL;
+	gchar * key = gst_add_tag_mux_pad_disk_key(addtagmuxpad, addtagmux,
+	    buffer, caps);
+	if (key) {
+	    made = gst_add_tag_mux_disk_lookup(key);
+	}
+	if (made) {
+	    GST_DEBUG_OBJECT(pad, "cached %s", key);
+	    gst_buffer_unref(buffer);
+	    buffer = gst_buffer_ref(gst_sample_get_buffer(made));
+	    gst_caps_unref(caps);
+	    caps = gst_caps_ref(gst_sample_get_caps(made));
+	} else {
+	    // create sample for (a scaled) image tag
+	    // unless we select among images first
+	    if (GST_ADD_TAG_MUX_SELECT_ALL == addtagmux->select) {
+		gst_add_tag_mux_fit(addtagmux, &buffer, &caps);
+	    }
+	    if (key) {
+		made = gst_add_tag_mux_sample_new(buffer, caps,
+		    addtagmuxpad->image_type);
+		gst_add_tag_mux_disk_insert(key, made);
+	    }
+	}
+	g_free(key);
+
+	// within our budget or else as we are told
+	GstFlowReturn ret = gst_add_tag_mux_pad_budget(addtagmuxpad, addtagmux,
+	    &buffer, &caps);
+	if (!buffer) {
+	    gst_caps_unref(caps);
+	    if (made) {
+		gst_sample_unref(made);
+	    }
+	    GST_TRACE_OBJECT(pad, "< %d", ret);
+	    return ret;
+	}
+
+	GstSample * sample = made && buffer == gst_sample_get_buffer(made)
+	    ? gst_sample_ref(made)
+	    : gst_add_tag_mux_sample_new(buffer, caps,
+		addtagmuxpad->image_type);
+	if (made) {
+	    gst_sample_unref(made);
+	}
+	gst_caps_unref(caps);
+	gst_add_tag_mux_pad_add_sample(addtagmuxpad, sample);
+	gst_sample_unref(sample);
+    }
+    gst_buffer_unref(buffer);
+
+    GST_TRACE_OBJECT(pad, "< OK");
+    return GST_FLOW_OK;
+}
+
+static GstFlowReturn
+gst_add_tag_mux_pad_sink_chain(
+    GstPad *		pad,
+    GstObject *		parent,
+    GstBuffer *		buffer)
+{
+    GST_TRACE_OBJECT(pad, ">");
+    GstAddTagMuxPad * addtagmuxpad = GST_ADD_TAG_MUX_PAD(pad);
+    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(parent);
+    GstFlowReturn ret;
+    addtagmuxpad->bytes += gst_buffer_get_size(buffer);
+    if (!addtagmuxpad->accumulate) {
+	ret = gst_add_tag_mux_pad_add_buffer(addtagmuxpad, addtagmux, buffer);
+    } else {
+	// chain the memory of each buffer to that of those before,
+	// without copying, to make one image of at EOS
+	addtagmuxpad->accumulated_bytes += gst_buffer_get_size(buffer);
+	guint max = addtagmuxpad->accumulate_max_bytes;
+	if (max && addtagmuxpad->accumulated_bytes > max) {
+	    GST_WARNING_OBJECT(pad, "image bigger than %u bytes", max);
+	    gst_buffer_unref(buffer);
+	    g_mutex_lock(&addtagmux->mutex);
+	    gst_add_tag_mux_pad_drop(addtagmuxpad, addtagmux);
+	    g_mutex_unlock(&addtagmux->mutex);
+	    ret = GST_FLOW_EOS;
+	} else {
+	    addtagmuxpad->accumulated = addtagmuxpad->accumulated
+		? gst_buffer_append(addtagmuxpad->accumulated, buffer)
+		: buffer;
+	    ret = GST_FLOW_OK;
+	}
+    }
+    g_mutex_lock(&addtagmux->mutex);
+    gst_add_tag_mux_pad_discard(addtagmuxpad, addtagmux);
+    g_mutex_unlock(&addtagmux->mutex);
+    GST_TRACE_OBJECT(pad, "< %d", ret);
+    return ret;
+}
+
+/// Resolve, once, what we need from the caps negotiated for a pad
+static void
+gst_add_tag_mux_pad_set_caps(
+    GstAddTagMuxPad *	addtagmuxpad,
+    GstAddTagMux *	addtagmux,
+    GstCaps *		caps)
+{
+    GST_DEBUG_OBJECT(addtagmuxpad, "caps %" GST_PTR_FORMAT, caps);
+
+    GstTagImageType image_type = GST_TAG_IMAGE_TYPE_FRONT_COVER;
+    // change the default image_type from the caps.
+    // this can be set with a capsfilter element with an image-type
+    // field whose string value can be converted (by name or nickname)
+    // to a GstTagImageType.
+    // For example, by inserting ...
+    //	image/jpeg,image-type=front-cover
+    // in the pipeline before us.
+    guint i = gst_caps_get_size(caps);
+    while (i--) {
+	gchar * n;
+	if (gst_structure_get(gst_caps_get_structure(caps, i),
+		"image-type", G_TYPE_STRING, &n,
+		NULL)) {
+	    gst_add_tag_mux_image_type_from_string(n, &image_type);
+	    g_free(n);
+	}
+    }
+    addtagmuxpad->image_type = image_type;
+
+    // fixed, known caps say what each buffer is, without typefinding it
+    if (addtagmuxpad->caps) {
+	gst_caps_unref(addtagmuxpad->caps);
+	addtagmuxpad->caps = NULL;
+    }
+    if (addtagmux->trust_caps && gst_caps_is_fixed(caps)) {
+	gchar const * name
+	    = gst_structure_get_name(gst_caps_get_structure(caps, 0));
+	if (g_str_has_prefix(name, "image/")
+		|| g_str_equal(name, "text/uri-list")) {
+	    addtagmuxpad->caps = gst_caps_new_empty_simple(name);
+	}
+    }
+}
+
+/// A linked additional stream is pending
+/// unless the main stream has already been released
+static GstPadLinkReturn gst_add_tag_mux_pad_link(
+    GstPad *		pad,
+    GstObject *		parent,
+    GstPad *		peer)
+{
+    GST_TRACE_OBJECT(pad, ">");
+    GstAddTagMuxPad * addtagmuxpad = GST_ADD_TAG_MUX_PAD(pad);
+    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(parent);
+    g_mutex_lock(&addtagmux->mutex);
+    // once passed through (see gst_add_tag_mux_passthrough)
+    // a stream is of no use, as after we are released,
+    // and must not make the main stream wait
+    gboolean useless = addtagmux->released || addtagmux->passed;
+    if (!addtagmuxpad->pending && !useless) {
+	addtagmuxpad->pending = TRUE;
+	++addtagmux->count;
+	if (addtagmuxpad->required) {
+	    ++addtagmux->required;
+	}
+	GST_DEBUG_OBJECT(pad, "pending %d %d",
+	    addtagmux->count, addtagmux->required);
+	// what a previous stream made is of no use
+	addtagmuxpad->dropped = FALSE;
+	if (addtagmuxpad->taglist) {
+	    gst_tag_list_unref(addtagmuxpad->taglist);
+	    addtagmuxpad->taglist = NULL;
+	}
+	// gst_pad_set_chain*_function insists on the pad's direction property
+	// being GST_PAD_SINK
+	gst_pad_set_chain_function(pad,
+	    GST_DEBUG_FUNCPTR(gst_add_tag_mux_pad_sink_chain));
+    } else if (useless) {
+	if (addtagmux->passed) {
+	    // what it makes its own thread discards
+	    addtagmuxpad->dropped = TRUE;
+	}
+	gst_pad_set_chain_function(pad,
+	    GST_DEBUG_FUNCPTR(gst_add_tag_mux_pad_sink_chain_eos));
+    }
+    g_mutex_unlock(&addtagmux->mutex);
+    GST_TRACE_OBJECT(pad, "< OK");
+    return GST_PAD_LINK_OK;
+}
+
+/// An unlinked additional stream that has not ended never will.
+/// Called with the pad lock held.
+static void gst_add_tag_mux_pad_unlink(
+    GstPad *		pad,
+    GstObject *		parent)
+{
+    GST_TRACE_OBJECT(pad, ">");
+    if (parent) {
+	GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(parent);
+	g_mutex_lock(&addtagmux->mutex);
+	gst_add_tag_mux_pad_drop(GST_ADD_TAG_MUX_PAD(pad), addtagmux);
+	g_mutex_unlock(&addtagmux->mutex);
+    }
+    GST_TRACE_OBJECT(pad, "<");
+}
+
+static gboolean gst_add_tag_mux_pad_sink_event(
+    GstPad *		pad,
+    GstObject *		parent,
+    GstEvent *		event)
+{
+    GST_TRACE_OBJECT(pad, ">");
+    switch (GST_EVENT_TYPE(event)) {
+	case GST_EVENT_EOS: {
+	    gst_pad_set_chain_function(pad,
+		GST_DEBUG_FUNCPTR(gst_add_tag_mux_pad_sink_chain_eos));
+	    GstAddTagMuxPad * addtagmuxpad = GST_ADD_TAG_MUX_PAD(pad);
+	    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(parent);
+	    g_mutex_lock(&addtagmux->mutex);
+	    gboolean dropped = addtagmuxpad->dropped;
+	    g_mutex_unlock(&addtagmux->mutex);
+	    // what was accumulated is now complete
+	    if (addtagmuxpad->accumulated) {
+		GstBuffer * buffer = addtagmuxpad->accumulated;
+		addtagmuxpad->accumulated = NULL;
+		addtagmuxpad->accumulated_bytes = 0;
+		if (dropped) {
+		    gst_buffer_unref(buffer);
+		} else {
+		    gst_add_tag_mux_pad_add_buffer(addtagmuxpad, addtagmux,
+			buffer);
+		}
+	    }
+	    // as is what was resolved
+	    g_mutex_lock(&addtagmux->mutex);
+	    GPtrArray * resolved = gst_add_tag_mux_pad_take_resolved(
+		addtagmuxpad, addtagmux);
+	    dropped = addtagmuxpad->dropped;
+	    g_mutex_unlock(&addtagmux->mutex);
+	    if (resolved) {
+		if (!dropped) {
+		    gst_add_tag_mux_pad_add_resolved(addtagmuxpad, addtagmux,
+			resolved);
+		}
+		gst_add_tag_mux_resolved_free(resolved);
+	    }
+	    // only cache a whole stream
+	    if (addtagmuxpad->cache_key) {
+		if (!dropped) {
+		    gst_add_tag_mux_cache_insert(addtagmuxpad->cache_key,
+			addtagmuxpad->samples);
+		}
+		g_free(addtagmuxpad->cache_key);
+		addtagmuxpad->cache_key = NULL;
+		g_ptr_array_unref(addtagmuxpad->samples);
+		addtagmuxpad->samples = NULL;
+	    }
+	    g_mutex_lock(&addtagmux->mutex);
+	    GST_DEBUG_OBJECT(pad, "EOS");
+	    gboolean late = addtagmux->released && addtagmuxpad->pending;
+	    gst_add_tag_mux_pad_settle(addtagmuxpad, addtagmux);
+	    if (late && addtagmux->late_tags && addtagmuxpad->taglist) {
+		// for the main streams to push
+		GST_INFO_OBJECT(pad, "late");
+		gst_add_tag_mux_late_tags(addtagmuxpad, addtagmux);
+	    }
+	    if (late) {
+		gst_add_tag_mux_pad_discharge(addtagmuxpad, addtagmux);
+	    }
+	    g_mutex_unlock(&addtagmux->mutex);
+	    break;
+	}
+	case GST_EVENT_FLUSH_STOP: {
+	    // an interrupted stream will not be continued
+	    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(parent);
+	    g_mutex_lock(&addtagmux->mutex);
+	    gst_add_tag_mux_pad_drop(GST_ADD_TAG_MUX_PAD(pad), addtagmux);
+	    g_mutex_unlock(&addtagmux->mutex);
+	    break;
+	}
+	case GST_EVENT_CAPS: {
+	    GstCaps * caps;
+	    gst_event_parse_caps(event, &caps);
+	    gst_add_tag_mux_pad_set_caps(GST_ADD_TAG_MUX_PAD(pad),
+		GST_ADD_TAG_MUX(parent), caps);
+	    break;
+	}
+	default:
+	    break;
+    }
+    gst_event_unref(event);
+    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(parent);
+    g_mutex_lock(&addtagmux->mutex);
+    gst_add_tag_mux_pad_discard(GST_ADD_TAG_MUX_PAD(pad), addtagmux);
+    g_mutex_unlock(&addtagmux->mutex);
+    GST_TRACE_OBJECT(pad, "< TRUE");
+    return TRUE;
+}
+
+static void
+gst_add_tag_mux_pad_init(
+    GstAddTagMuxPad *	addtagmuxpad)
+{
+    GST_TRACE_OBJECT(addtagmuxpad, ">");
+    GstPad * pad = GST_PAD(addtagmuxpad);
+
+    addtagmuxpad->image_type = GST_TAG_IMAGE_TYPE_FRONT_COVER;
+    addtagmuxpad->required = TRUE;
+    addtagmuxpad->priority = 0;
+    addtagmuxpad->index = 0;
+    addtagmuxpad->accumulate = FALSE;
+    addtagmuxpad->accumulate_max_bytes = DEFAULT_PAD_ACCUMULATE_MAX_BYTES;
+    g_cond_init(&addtagmuxpad->resolve_cond);
+
+    GST_OBJECT_FLAG_SET(pad, GST_PAD_FLAG_NEED_PARENT);
+    gst_pad_set_link_function(pad,
+	GST_DEBUG_FUNCPTR(gst_add_tag_mux_pad_link));
+    gst_pad_set_unlink_function(pad,
+	GST_DEBUG_FUNCPTR(gst_add_tag_mux_pad_unlink));
+    gst_pad_set_event_function(pad,
+	GST_DEBUG_FUNCPTR(gst_add_tag_mux_pad_sink_event));
+
+    GST_TRACE_OBJECT(addtagmuxpad, "<");
+}
+
+/// Our sink pads are our children, so that their properties may be set
+/// (for example, by gst-launch) with ours
+static GObject *
+gst_add_tag_mux_child_proxy_get_child_by_index(
+    GstChildProxy *	child_proxy,
+    guint		index)
+{
+    GstElement * element = GST_ELEMENT(child_proxy);
+    GST_OBJECT_LOCK(element);
+    GObject * ret = g_list_nth_data(element->sinkpads, index);
+    if (ret) {
+	gst_object_ref(ret);
+    }
+    GST_OBJECT_UNLOCK(element);
+    return ret;
+}
+
+static guint
+gst_add_tag_mux_child_proxy_get_children_count(
+    GstChildProxy *	child_proxy)
+{
+    GstElement * element = GST_ELEMENT(child_proxy);
+    GST_OBJECT_LOCK(element);
+    guint ret = element->numsinkpads;
+    GST_OBJECT_UNLOCK(element);
+    return ret;
+}
+
+static void
+gst_add_tag_mux_child_proxy_init(
+    gpointer		g_iface,
+    gpointer		iface_data)
+{
+    GstChildProxyInterface * iface = g_iface;
+    iface->get_child_by_index
+	= gst_add_tag_mux_child_proxy_get_child_by_index;
+    iface->get_children_count
+	= gst_add_tag_mux_child_proxy_get_children_count;
+}
+
+// define gst_add_tag_mux class as a subclass of gst_element.
+// defines static variable gst_add_tag_mux_parent_class
+G_DEFINE_TYPE_WITH_CODE (
     GstAddTagMux,
     gst_add_tag_mux,
     GST_TYPE_ELEMENT,
@@ -286,222 +1900,1934 @@ G_DEFINE_TYPE_WITH_CODE (
 	"addtagmux",
 	0,
 	"debug category for addtagmux element"
+    );
+    G_IMPLEMENT_INTERFACE(
+	GST_TYPE_CHILD_PROXY,
+	gst_add_tag_mux_child_proxy_init
     )
 );
 
-/// GObject disposal for GstAddTagMux
-/// https://developer.gnome.org/gobject/stable/howto-gobject-destruction.html
+/// GObject disposal for GstAddTagMux
+/// https://developer.gnome.org/gobject/stable/howto-gobject-destruction.html
+static void
+gst_add_tag_mux_dispose(
+    GObject *		object)
+{
+    GST_TRACE_OBJECT(object, ">");
+    // dispose addtagmux
+    G_OBJECT_CLASS(gst_add_tag_mux_parent_class)->dispose(object);
+    GST_TRACE_OBJECT(object, "<");
+}
+
+static GstAddTagMuxPair * gst_add_tag_mux_pair_new(GstAddTagMux * addtagmux,
+    GstPad * sink, GstPad * src);
+static void gst_add_tag_mux_pair_free(GstAddTagMuxPair * pair);
+static void gst_add_tag_mux_unwatch_errors(GstAddTagMux * addtagmux);
+
+/// GObject finalization for GstAddTagMux
+/// https://developer.gnome.org/gobject/stable/howto-gobject-destruction.html
+static void
+gst_add_tag_mux_finalize(
+    GObject *		object)
+{
+    GST_TRACE_OBJECT(object, ">");
+
+    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(object);
+    gst_add_tag_mux_unwatch_errors(addtagmux);
+    g_list_free_full(addtagmux->pairs,
+	(GDestroyNotify) gst_add_tag_mux_pair_free);
+    g_list_free_full(addtagmux->kept, gst_object_unref);
+    g_cond_clear(&addtagmux->cond);
+    g_mutex_clear(&addtagmux->mutex);
+    if (addtagmux->taglist) {
+	gst_tag_list_unref(addtagmux->taglist);
+    }
+    g_free(addtagmux->location);
+    g_free(addtagmux->cover_directory);
+    g_free(addtagmux->cover_patterns);
+    if (addtagmux->stats) {
+	gst_structure_free(addtagmux->stats);
+    }
+
+    G_OBJECT_CLASS(gst_add_tag_mux_parent_class)->finalize(object);
+    GST_TRACE("<");
+}
+
+static GstPad *
+gst_add_tag_mux_request_new_pad(
+    GstElement *	element,
+    GstPadTemplate *	template,
+    gchar const *	name_,
+    GstCaps const *	caps)
+{
+    GST_TRACE_OBJECT(element, "> name=%s, caps=%" GST_PTR_FORMAT, name_, caps);
+    GstElementClass * element_class = GST_ELEMENT_GET_CLASS(element);
+    if (template == gst_element_class_get_pad_template(element_class,
+	    "main_sink_%u")) {
+	// another main stream, with its src pad
+	GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(element);
+	g_mutex_lock(&addtagmux->mutex);
+	gint index = addtagmux->pair_index++;
+	g_mutex_unlock(&addtagmux->mutex);
+	gchar * name = g_strdup_printf("main_sink_%d", index);
+	GstPad * sink = gst_pad_new_from_template(template, name);
+	g_free(name);
+	name = g_strdup_printf("main_src_%d", index);
+	GstPad * src = gst_pad_new_from_template(
+	    gst_element_class_get_pad_template(element_class, "main_src_%u"),
+	    name);
+	g_free(name);
+	gst_add_tag_mux_pair_new(addtagmux, sink, src);
+	gst_child_proxy_child_added(GST_CHILD_PROXY(element), G_OBJECT(sink),
+	    GST_OBJECT_NAME(sink));
+	GST_TRACE_OBJECT(element, "< %" GST_PTR_FORMAT, sink);
+	return sink;
+    }
+    if (GST_PAD_SINK != template->direction) {
+	GST_ERROR_OBJECT(element, "template not a sink");
+	GST_TRACE_OBJECT(element, "< NULL");
+	return NULL;
+    }
+
+    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(element);
+    g_mutex_lock(&addtagmux->mutex);
+    gint index = addtagmux->index++;
+    g_mutex_unlock(&addtagmux->mutex);
+    gchar * name
+	= g_strdup_printf(GST_PAD_TEMPLATE_NAME_TEMPLATE(template), index);
+    GstPad * pad = g_object_new(GST_TYPE_ADD_TAG_MUX_PAD,
+	// these properties are set *after* object is initialized
+	"name",		name,
+	"direction",	template->direction,
+	"template",	template,
+	NULL);
+    g_free(name);
+    GST_ADD_TAG_MUX_PAD(pad)->index = index;
+    gst_element_add_pad(element, pad);
+    gst_child_proxy_child_added(GST_CHILD_PROXY(element), G_OBJECT(pad),
+	GST_OBJECT_NAME(pad));
+
+    GST_TRACE_OBJECT(element, "< %" GST_PTR_FORMAT, pad);
+    return pad;
+}
+
+static void
+gst_add_tag_mux_release_pad(
+    GstElement *	element,
+    GstPad *		pad)
+{
+    GST_TRACE_OBJECT(element, "> %" GST_PTR_FORMAT, pad);
+    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(element);
+    if (!GST_IS_ADD_TAG_MUX_PAD(pad)) {
+	// a requested main stream, let go of any wait, with its src pad
+	GstAddTagMuxPair * pair = gst_pad_get_element_private(pad);
+	g_mutex_lock(&addtagmux->mutex);
+	pair->flushing = TRUE;
+	g_cond_broadcast(&addtagmux->cond);
+	addtagmux->pairs = g_list_remove(addtagmux->pairs, pair);
+	g_mutex_unlock(&addtagmux->mutex);
+	gst_child_proxy_child_removed(GST_CHILD_PROXY(element),
+	    G_OBJECT(pair->sink), GST_OBJECT_NAME(pair->sink));
+	gst_element_remove_pad(element, pair->sink);
+	gst_element_remove_pad(element, pair->src);
+	gst_add_tag_mux_pair_free(pair);
+	GST_TRACE_OBJECT(element, "<");
+	return;
+    }
+    GstAddTagMuxPad * addtagmuxpad = GST_ADD_TAG_MUX_PAD(pad);
+
+    // whether its stream has ended, before removal settles it
+    g_mutex_lock(&addtagmux->mutex);
+    gboolean ended = !addtagmuxpad->pending && !addtagmuxpad->dropped;
+    g_mutex_unlock(&addtagmux->mutex);
+
+    GST_OBJECT_LOCK(addtagmux);
+    if (addtagmuxpad->source) {
+	gst_element_set_locked_state(addtagmuxpad->source, FALSE);
+	gst_object_unref(addtagmuxpad->source);
+	addtagmuxpad->source = NULL;
+    }
+    GST_OBJECT_UNLOCK(addtagmux);
+
+    // removal unlinks the pad, which settles it if pending,
+    // and deactivates it, so its streaming thread is done with it
+    gst_object_ref(addtagmuxpad);
+    gst_child_proxy_child_removed(GST_CHILD_PROXY(element), G_OBJECT(pad),
+	GST_OBJECT_NAME(pad));
+    gst_element_remove_pad(element, pad);
+
+    // keep a stream that has ended, with its tags,
+    // to be merged in order with the others when the main stream is released.
+    // otherwise, what it holds will never be merged
+    g_mutex_lock(&addtagmux->mutex);
+    if (ended && !addtagmuxpad->dropped
+	    && addtagmuxpad->taglist && !addtagmux->released) {
+	addtagmux->kept = g_list_prepend(addtagmux->kept,
+	    gst_object_ref(addtagmuxpad));
+    } else {
+	gst_add_tag_mux_pad_discharge(addtagmuxpad, addtagmux);
+    }
+    g_mutex_unlock(&addtagmux->mutex);
+    gst_object_unref(addtagmuxpad);
+
+    GST_TRACE_OBJECT(element, "<");
+}
+
+/// Describe an element by its factory
+/// and the values of its (read/write) properties
+static void
+gst_add_tag_mux_describe(
+    GString *		description,
+    GstElement *	element)
+{
+    GstElementFactory * factory = gst_element_get_factory(element);
+    g_string_append(description, factory
+	? GST_OBJECT_NAME(factory) : G_OBJECT_TYPE_NAME(element));
+    guint n;
+    GParamSpec ** pspecs
+	= g_object_class_list_properties(G_OBJECT_GET_CLASS(element), &n);
+    guint i;
+    for (i = 0; i < n; ++i) {
+	GParamSpec * pspec = pspecs[i];
+	if (G_PARAM_READWRITE != (pspec->flags & G_PARAM_READWRITE)
+		|| g_str_equal(pspec->name, "name")
+		|| g_str_equal(pspec->name, "parent")) {
+	    continue;
+	}
+	GValue value = G_VALUE_INIT;
+	g_value_init(&value, pspec->value_type);
+	g_object_get_property(G_OBJECT(element), pspec->name, &value);
+	gchar * s = gst_value_serialize(&value);
+	if (s) {
+	    g_string_append_printf(description, " %s=%s", pspec->name, s);
+	    g_free(s);
+	}
+	g_value_unset(&value);
+    }
+    g_free(pspecs);
+    g_string_append(description, " ! ");
+}
+
+/// Return a key that identifies the samples that the stream to this pad
+/// would make (or NULL, if we can't) and the source of this stream.
+/// The key describes the elements upstream, to the source,
+/// and the identity (path, modification time and size) of its file.
+static gchar *
+gst_add_tag_mux_pad_cache_key(
+    GstPad *		pad,
+    GstElement **	source)
+{
+    GST_TRACE_OBJECT(pad, ">");
+    GString * key = g_string_new(NULL);
+    GstElement * element = NULL;
+    GstPad * peer = gst_pad_get_peer(pad);
+    while (peer) {
+	element = gst_pad_get_parent_element(peer);
+	gst_object_unref(peer);
+	peer = NULL;
+	if (!element) {
+	    break;
+	}
+	gst_add_tag_mux_describe(key, element);
+	GST_OBJECT_LOCK(element);
+	guint16 sinkpads = element->numsinkpads;
+	if (1 == sinkpads) {
+	    peer = gst_pad_get_peer(GST_PAD(element->sinkpads->data));
+	}
+	GST_OBJECT_UNLOCK(element);
+	if (!sinkpads) {
+	    break;		// source
+	}
+	gst_object_unref(element);
+	element = NULL;
+    }
+
+    gchar * ret = NULL;
+    if (element) {
+	GstQuery * query = gst_query_new_uri();
+	gchar * uri = NULL;
+	if (gst_element_query(element, query)) {
+	    gst_query_parse_uri(query, &uri);
+	}
+	gst_query_unref(query);
+	gchar * path = uri ? g_filename_from_uri(uri, NULL, NULL) : NULL;
+	struct stat st;
+	// to the nanosecond, should a file be rewritten within a second
+	if (path && !stat(path, &st)) {
+	    g_string_append_printf(key, "%s %" G_GINT64_FORMAT
+		".%09ld %" G_GINT64_FORMAT, path,
+		(gint64) st.st_mtim.tv_sec, (long) st.st_mtim.tv_nsec,
+		(gint64) st.st_size);
+	    ret = g_string_free(key, FALSE);
+	    key = NULL;
+	    *source = element;
+	    element = NULL;
+	}
+	g_free(path);
+	g_free(uri);
+	if (element) {
+	    gst_object_unref(element);
+	}
+    }
+    if (key) {
+	g_string_free(key, TRUE);
+    }
+    GST_TRACE_OBJECT(pad, "< %s", ret);
+    return ret;
+}
+
+/// A GCopyFunc that refs a GstObject
+static gpointer
+gst_add_tag_mux_copy_ref(
+    gconstpointer	src,
+    gpointer		data)
+{
+    return gst_object_ref((gpointer) src);
+}
+
+/// When caching, look up the samples of each additional stream.
+/// If found, the stream is no longer pending
+/// and its source is kept from starting.
+/// Otherwise, remember how to cache what the stream makes.
+static void
+gst_add_tag_mux_cache_lookup_pads(
+    GstAddTagMux *	addtagmux)
+{
+    GST_TRACE_OBJECT(addtagmux, ">");
+    if (gst_add_tag_mux_cache_get_max_bytes()) {
+	GST_OBJECT_LOCK(addtagmux);
+	GList * pads = g_list_copy_deep(GST_ELEMENT(addtagmux)->sinkpads,
+	    gst_add_tag_mux_copy_ref, NULL);
+	GST_OBJECT_UNLOCK(addtagmux);
+	GList * link;
+	for (link = pads; link; link = link->next) {
+	    if (!GST_IS_ADD_TAG_MUX_PAD(link->data)) {
+		continue;
+	    }
+	    GstAddTagMuxPad * addtagmuxpad = GST_ADD_TAG_MUX_PAD(link->data);
+	    GstElement * source;
+	    gchar * key = gst_add_tag_mux_pad_cache_key(
+		GST_PAD(addtagmuxpad), &source);
+	    if (!key) {
+		continue;
+	    }
+	    // what we make depends on how we make it
+	    gchar * made = g_strdup_printf("%s accumulate=%d/%u"
+		" trust-caps=%d resolve-uris=%d select=%d %ux%u", key,
+		addtagmuxpad->accumulate, addtagmuxpad->accumulate_max_bytes,
+		addtagmux->trust_caps, addtagmux->resolve_uris,
+		addtagmux->select, addtagmux->max_width, addtagmux->max_height);
+	    g_free(key);
+	    key = made;
+	    GPtrArray * samples = gst_add_tag_mux_cache_lookup(key);
+	    if (samples) {
+		GST_INFO_OBJECT(addtagmuxpad, "cached %s", key);
+		gst_element_set_locked_state(source, TRUE);
+		addtagmuxpad->source = source;
+		gst_pad_set_chain_function(GST_PAD(addtagmuxpad),
+		    GST_DEBUG_FUNCPTR(gst_add_tag_mux_pad_sink_chain_eos));
+		// charged like any other image.
+		// its streaming thread will not run so this one owns its taglist
+		gst_add_tag_mux_pad_add_resolved(addtagmuxpad, addtagmux,
+		    samples);
+		g_mutex_lock(&addtagmux->mutex);
+		gst_add_tag_mux_pad_settle(addtagmuxpad, addtagmux);
+		gst_add_tag_mux_pad_discard(addtagmuxpad, addtagmux);
+		g_mutex_unlock(&addtagmux->mutex);
+		g_ptr_array_unref(samples);
+		g_free(key);
+	    } else {
+		gst_object_unref(source);
+		g_free(addtagmuxpad->cache_key);
+		addtagmuxpad->cache_key = key;
+		if (addtagmuxpad->samples) {
+		    g_ptr_array_unref(addtagmuxpad->samples);
+		}
+		addtagmuxpad->samples = g_ptr_array_new_with_free_func(
+		    (GDestroyNotify) gst_sample_unref);
+	    }
+	}
+	g_list_free_full(pads, gst_object_unref);
+    }
+    GST_TRACE_OBJECT(addtagmux, "<");
+}
+
+/// Split an entry, [image-type=]rest, in place.
+/// Return rest and its image-type (front-cover by default).
+static gchar const *
+gst_add_tag_mux_image_type_split(
+    gchar *		entry,
+    GstTagImageType *	image_type)
+{
+    *image_type = GST_TAG_IMAGE_TYPE_FRONT_COVER;
+    gchar * equal = strchr(entry, '=');
+    if (equal) {
+	*equal = 0;
+	if (gst_add_tag_mux_image_type_from_string(entry, image_type)) {
+	    return equal + 1;
+	}
+	*equal = '=';	// part of rest
+    }
+    return entry;
+}
+
+/// Add an image tag from the content of a file, within our budgets.
+/// Return FALSE (with a warning) if we could not.
+static gboolean
+gst_add_tag_mux_file_load(
+    GstAddTagMux *	addtagmux,
+    gchar const *	path,
+    GstTagImageType	image_type)
+{
+    GError * error = NULL;
+    GstSample * sample = gst_add_tag_mux_sample_new_from_file(
+	addtagmux, path, image_type, &error);
+    if (!sample) {
+	GST_ELEMENT_WARNING(addtagmux, RESOURCE, OPEN_READ,
+	    ("Could not add image from %s", path),
+	    ("%s", error->message));
+	g_error_free(error);
+	return FALSE;
+    }
+    GstBuffer * buffer = gst_buffer_ref(gst_sample_get_buffer(sample));
+    GstCaps * caps = gst_caps_ref(gst_sample_get_caps(sample));
+    gst_add_tag_mux_pad_budget(NULL, addtagmux, &buffer, &caps);
+    if (buffer && buffer != gst_sample_get_buffer(sample)) {
+	GstSample * scaled = gst_add_tag_mux_sample_new(buffer, caps,
+	    image_type);
+	gst_sample_unref(sample);
+	sample = scaled;
+    }
+    gst_caps_unref(caps);
+    if (!buffer) {
+	gst_sample_unref(sample);
+	return FALSE;
+    }
+    gst_buffer_unref(buffer);
+    g_mutex_lock(&addtagmux->mutex);
+    gst_tag_list_add(addtagmux->taglist, GST_TAG_MERGE_APPEND,
+	GST_TAG_IMAGE, sample,
+	NULL);
+    g_mutex_unlock(&addtagmux->mutex);
+    gst_sample_unref(sample);
+    return TRUE;
+}
+
+/// Add image tags from the files named by our location property.
+/// This is done without streaming so nothing is pending.
+static void
+gst_add_tag_mux_location_load(
+    GstAddTagMux *	addtagmux)
+{
+    GST_TRACE_OBJECT(addtagmux, ">");
+    g_mutex_lock(&addtagmux->mutex);
+    gchar ** entries = addtagmux->location
+	? g_strsplit(addtagmux->location, G_SEARCHPATH_SEPARATOR_S, -1)
+	: NULL;
+    g_mutex_unlock(&addtagmux->mutex);
+    gchar ** entry;
+    for (entry = entries; entry && *entry; ++entry) {
+	if (!**entry) {
+	    continue;
+	}
+	GstTagImageType image_type;
+	gchar const * path
+	    = gst_add_tag_mux_image_type_split(*entry, &image_type);
+	gst_add_tag_mux_file_load(addtagmux, path, image_type);
+    }
+    g_strfreev(entries);
+    GST_TRACE_OBJECT(addtagmux, "<");
+}
+
+/// Add image tags from the files in our cover-directory
+/// whose names match our cover-patterns (ignoring case).
+/// Each image-type is added once: from the first name (in order)
+/// matching the first of its patterns that matches any.
+/// The names in the directory are shared with other elements
+/// (see gstaddtagmuxfolder.h) so that an album is read once.
+static void
+gst_add_tag_mux_cover_load(
+    GstAddTagMux *	addtagmux)
+{
+    GST_TRACE_OBJECT(addtagmux, ">");
+    g_mutex_lock(&addtagmux->mutex);
+    gchar * directory = addtagmux->cover_directory
+	&& *addtagmux->cover_directory && addtagmux->cover_patterns
+	? g_strdup(addtagmux->cover_directory)
+	: NULL;
+    gchar ** entries = directory
+	? g_strsplit(addtagmux->cover_patterns, G_SEARCHPATH_SEPARATOR_S, -1)
+	: NULL;
+    g_mutex_unlock(&addtagmux->mutex);
+    GPtrArray * names = directory
+	? gst_add_tag_mux_folder_list(directory)
+	: NULL;
+    if (names) {
+	// lower case names to match
+	gchar ** lower = g_new(gchar *, names->len);
+	guint i;
+	for (i = 0; i < names->len; ++i) {
+	    lower[i] = g_utf8_strdown(g_ptr_array_index(names, i), -1);
+	}
+	guint32 found = 0;		// image-types, by bit
+	gchar ** entry;
+	for (entry = entries; *entry; ++entry) {
+	    if (!**entry) {
+		continue;
+	    }
+	    GstTagImageType image_type;
+	    gchar const * pattern
+		= gst_add_tag_mux_image_type_split(*entry, &image_type);
+	    guint32 bit = 1u << (image_type - GST_TAG_IMAGE_TYPE_NONE);
+	    if (found & bit) {
+		continue;
+	    }
+	    gchar * p = g_utf8_strdown(pattern, -1);
+	    for (i = 0; i < names->len; ++i) {
+		if (!g_pattern_match_simple(p, lower[i])) {
+		    continue;
+		}
+		gchar * path = g_build_filename(directory,
+		    g_ptr_array_index(names, i), NULL);
+		GST_DEBUG_OBJECT(addtagmux, "%s %s", pattern, path);
+		if (gst_add_tag_mux_file_load(addtagmux, path, image_type)) {
+		    found |= bit;
+		}
+		g_free(path);
+		break;
+	    }
+	    g_free(p);
+	}
+	for (i = 0; i < names->len; ++i) {
+	    g_free(lower[i]);
+	}
+	g_free(lower);
+	g_ptr_array_unref(names);
+    }
+    g_strfreev(entries);
+    g_free(directory);
+    GST_TRACE_OBJECT(addtagmux, "<");
+}
+
+/// Let the sources of streams that were found in the cache
+/// follow state changes again
+static void
+gst_add_tag_mux_cache_unlock_sources(
+    GstAddTagMux *	addtagmux)
+{
+    GST_TRACE_OBJECT(addtagmux, ">");
+    GST_OBJECT_LOCK(addtagmux);
+    GList * link;
+    for (link = GST_ELEMENT(addtagmux)->sinkpads; link; link = link->next) {
+	if (GST_IS_ADD_TAG_MUX_PAD(link->data)) {
+	    GstAddTagMuxPad * addtagmuxpad = GST_ADD_TAG_MUX_PAD(link->data);
+	    if (addtagmuxpad->source) {
+		gst_element_set_locked_state(addtagmuxpad->source, FALSE);
+		gst_object_unref(addtagmuxpad->source);
+		addtagmuxpad->source = NULL;
+	    }
+	}
+    }
+    GST_OBJECT_UNLOCK(addtagmux);
+    GST_TRACE_OBJECT(addtagmux, "<");
+}
+
+/// Whether an object is, or is within, an element upstream of a pad
+static gboolean
+gst_add_tag_mux_pad_is_upstream(
+    GstPad *		pad,
+    GstObject *		object)
+{
+    gboolean ret = FALSE;
+    GHashTable * seen = g_hash_table_new_full(NULL, NULL,
+	gst_object_unref, NULL);
+    GQueue sinks = G_QUEUE_INIT;
+    g_queue_push_tail(&sinks, gst_object_ref(pad));
+    GstPad * sink;
+    while (!ret && (sink = g_queue_pop_head(&sinks))) {
+	GstPad * peer = gst_pad_get_peer(sink);
+	gst_object_unref(sink);
+	if (!peer) {
+	    continue;
+	}
+	GstElement * element = gst_pad_get_parent_element(peer);
+	if (!element && GST_IS_PROXY_PAD(peer)) {
+	    // within a bin, continue from outside of its ghost pad
+	    GstProxyPad * ghost = gst_proxy_pad_get_internal(
+		GST_PROXY_PAD(peer));
+	    if (ghost) {
+		g_queue_push_tail(&sinks, ghost);
+	    }
+	}
+	gst_object_unref(peer);
+	if (!element) {
+	    continue;
+	}
+	if (g_hash_table_contains(seen, element)) {
+	    gst_object_unref(element);
+	    continue;
+	}
+	g_hash_table_add(seen, element);
+	ret = GST_OBJECT(element) == object
+	    || gst_object_has_as_ancestor(object, GST_OBJECT(element));
+	GST_OBJECT_LOCK(element);
+	GList * link;
+	for (link = element->sinkpads; link; link = link->next) {
+	    g_queue_push_tail(&sinks, gst_object_ref(link->data));
+	}
+	GST_OBJECT_UNLOCK(element);
+    }
+    while ((sink = g_queue_pop_head(&sinks))) {
+	gst_object_unref(sink);
+    }
+    g_hash_table_unref(seen);
+    return ret;
+}
+
+/// An error posted upstream of an additional stream
+/// (a source that could not start or a parser that gave up)
+/// may leave it without an EOS, so it is no longer pending.
+/// Called in the thread that posted it.
+static void
+gst_add_tag_mux_bus_error(
+    GstBus *		bus,
+    GstMessage *	message,
+    GstAddTagMux *	addtagmux)
+{
+    GstObject * src = GST_MESSAGE_SRC(message);
+    if (!src || GST_OBJECT(addtagmux) == src) {
+	return;
+    }
+    GST_OBJECT_LOCK(addtagmux);
+    GList * pads = g_list_copy_deep(GST_ELEMENT(addtagmux)->sinkpads,
+	gst_add_tag_mux_copy_ref, NULL);
+    GST_OBJECT_UNLOCK(addtagmux);
+    GList * link;
+    for (link = pads; link; link = link->next) {
+	if (!GST_IS_ADD_TAG_MUX_PAD(link->data)
+		|| !gst_add_tag_mux_pad_is_upstream(link->data, src)) {
+	    continue;
+	}
+	GST_WARNING_OBJECT(link->data, "error upstream from %" GST_PTR_FORMAT,
+	    src);
+	g_mutex_lock(&addtagmux->mutex);
+	gst_add_tag_mux_pad_drop(link->data, addtagmux);
+	g_mutex_unlock(&addtagmux->mutex);
+    }
+    g_list_free_full(pads, gst_object_unref);
+}
+
+static void
+gst_add_tag_mux_unwatch_errors(
+    GstAddTagMux *	addtagmux)
+{
+    GST_TRACE_OBJECT(addtagmux, ">");
+    if (addtagmux->bus) {
+	gst_bus_disable_sync_message_emission(addtagmux->bus);
+	g_signal_handlers_disconnect_by_func(addtagmux->bus,
+	    gst_add_tag_mux_bus_error, addtagmux);
+	gst_object_unref(addtagmux->bus);
+	addtagmux->bus = NULL;
+    }
+    GST_TRACE_OBJECT(addtagmux, "<");
+}
+
+/// Watch the bus of our top-level bin for errors upstream.
+/// A bus has only one sync handler (the bin's)
+/// but it may emit sync-message signals to any number of others.
+static void
+gst_add_tag_mux_watch_errors(
+    GstAddTagMux *	addtagmux)
+{
+    GST_TRACE_OBJECT(addtagmux, ">");
+    // from a state change to PAUSED that failed
+    gst_add_tag_mux_unwatch_errors(addtagmux);
+    GstObject * top = gst_object_ref(addtagmux);
+    GstObject * parent;
+    while ((parent = gst_object_get_parent(top))) {
+	gst_object_unref(top);
+	top = parent;
+    }
+    GstBus * bus = GST_IS_ELEMENT(top)
+	? gst_element_get_bus(GST_ELEMENT(top))
+	: NULL;
+    gst_object_unref(top);
+    if (bus) {
+	g_signal_connect(bus, "sync-message::error",
+	    G_CALLBACK(gst_add_tag_mux_bus_error), addtagmux);
+	gst_bus_enable_sync_message_emission(bus);
+    }
+    addtagmux->bus = bus;
+    GST_TRACE_OBJECT(addtagmux, "< %p", bus);
+}
+
+static void gst_add_tag_mux_reset(GstAddTagMux * addtagmux);
+
+static GstStateChangeReturn
+gst_add_tag_mux_change_state(
+    GstElement *	element,
+    GstStateChange	transition)
+{
+    GST_TRACE_OBJECT(element, "> %s", gst_state_change_get_name(transition));
+    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(element);
+    GList * link;
+
+    // elements upstream of us change state after we do
+    switch (transition) {
+	case GST_STATE_CHANGE_READY_TO_PAUSED:
+	    g_mutex_lock(&addtagmux->mutex);
+	    addtagmux->deadline = addtagmux->timeout
+		? g_get_monotonic_time()
+		    + GST_TIME_AS_USECONDS(addtagmux->timeout)
+		: 0;
+	    for (link = addtagmux->pairs; link; link = link->next) {
+		GstAddTagMuxPair * pair = link->data;
+		pair->scanning
+		    = GST_TAG_IMAGE_TYPE_NONE != addtagmux->passthrough;
+		gst_add_tag_mux_flac_scan_init(&pair->flac_scan);
+	    }
+	    g_mutex_unlock(&addtagmux->mutex);
+	    gst_add_tag_mux_location_load(addtagmux);
+	    gst_add_tag_mux_cover_load(addtagmux);
+	    gst_add_tag_mux_cache_lookup_pads(addtagmux);
+	    gst_add_tag_mux_watch_errors(addtagmux);
+	    break;
+	case GST_STATE_CHANGE_PAUSED_TO_READY:
+	    gst_add_tag_mux_unwatch_errors(addtagmux);
+	    gst_add_tag_mux_cache_unlock_sources(addtagmux);
+	    // release waiting main streams so their pads can be deactivated
+	    g_mutex_lock(&addtagmux->mutex);
+	    for (link = addtagmux->pairs; link; link = link->next) {
+		((GstAddTagMuxPair *) link->data)->flushing = TRUE;
+	    }
+	    g_cond_broadcast(&addtagmux->cond);
+	    g_mutex_unlock(&addtagmux->mutex);
+	    break;
+	default:
+	    break;
+    }
+
+    GstStateChangeReturn ret = GST_ELEMENT_CLASS(gst_add_tag_mux_parent_class)
+	->change_state(element, transition);
+
+    switch (transition) {
+	case GST_STATE_CHANGE_PAUSED_TO_READY:
+	    gst_add_tag_mux_reset(addtagmux);
+	    break;
+	default:
+	    break;
+    }
+
+    GST_TRACE_OBJECT(element, "< %d", ret);
+    return ret;
+}
+
+/// A "sink_%u" SINK pad exists only on REQUEST
+/// and only supports streams that we can turn into tags
+static GstStaticPadTemplate gst_add_tag_mux_pad_sink_template =
+GST_STATIC_PAD_TEMPLATE(
+    "sink_%u",
+    GST_PAD_SINK,
+    GST_PAD_REQUEST,
+    GST_STATIC_CAPS(
+	"image/jpeg;"
+	"image/png;"
+	"text/uri-list")
+);
+
+/// Our "sink" SINK pad ALWAYS exists and supports ANYthing
+static GstStaticPadTemplate gst_add_tag_mux_sink_template =
+GST_STATIC_PAD_TEMPLATE(
+    "sink",
+    GST_PAD_SINK,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY
+);
+
+/// Our "src" SRC pad ALWAYS exists and supports ANYthing
+static GstStaticPadTemplate gst_add_tag_mux_src_template =
+GST_STATIC_PAD_TEMPLATE(
+    "src",
+    GST_PAD_SRC,
+    GST_PAD_ALWAYS,
+    GST_STATIC_CAPS_ANY
+);
+
+/// A "main_sink_%u" SINK pad exists only on REQUEST, for another main stream,
+/// and supports ANYthing
+static GstStaticPadTemplate gst_add_tag_mux_main_sink_template =
+GST_STATIC_PAD_TEMPLATE(
+    "main_sink_%u",
+    GST_PAD_SINK,
+    GST_PAD_REQUEST,
+    GST_STATIC_CAPS_ANY
+);
+
+/// A "main_src_%u" SRC pad exists SOMETIMES (with its "main_sink_%u")
+/// and supports ANYthing
+static GstStaticPadTemplate gst_add_tag_mux_main_src_template =
+GST_STATIC_PAD_TEMPLATE(
+    "main_src_%u",
+    GST_PAD_SRC,
+    GST_PAD_SOMETIMES,
+    GST_STATIC_CAPS_ANY
+);
+
+static void
+gst_add_tag_mux_set_property(
+    GObject *		object,
+    guint		property_id,
+    GValue const *	value,
+    GParamSpec *	pspec)
+{
+    GST_TRACE_OBJECT(object, ">");
+    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(object);
+    g_mutex_lock(&addtagmux->mutex);
+    switch (property_id) {
+	case PROP_MAX_SIZE_BUFFERS:
+	    addtagmux->max_size_buffers = g_value_get_uint(value);
+	    break;
+	case PROP_MAX_SIZE_BYTES:
+	    addtagmux->max_size_bytes = g_value_get_uint(value);
+	    break;
+	case PROP_MAX_SIZE_TIME:
+	    addtagmux->max_size_time = g_value_get_uint64(value);
+	    break;
+	case PROP_CACHE_MAX_BYTES:
+	    gst_add_tag_mux_cache_set_max_bytes(g_value_get_uint64(value));
+	    break;
+	case PROP_LOCATION:
+	    g_free(addtagmux->location);
+	    addtagmux->location = g_value_dup_string(value);
+	    break;
+	case PROP_TRUST_CAPS:
+	    addtagmux->trust_caps = g_value_get_boolean(value);
+	    break;
+	case PROP_TIMEOUT:
+	    addtagmux->timeout = g_value_get_uint64(value);
+	    break;
+	case PROP_LATE_TAGS:
+	    addtagmux->late_tags = g_value_get_boolean(value);
+	    break;
+	case PROP_DEDUPE:
+	    addtagmux->dedupe = g_value_get_boolean(value);
+	    break;
+	case PROP_MAX_WIDTH:
+	    addtagmux->max_width = g_value_get_uint(value);
+	    break;
+	case PROP_MAX_HEIGHT:
+	    addtagmux->max_height = g_value_get_uint(value);
+	    break;
+	case PROP_SELECT:
+	    addtagmux->select = g_value_get_enum(value);
+	    break;
+	case PROP_MAX_BYTES:
+	    addtagmux->max_bytes = g_value_get_uint64(value);
+	    break;
+	case PROP_PROCESS_MAX_BYTES:
+	    g_mutex_lock(&budget.mutex);
+	    budget.max_bytes = g_value_get_uint64(value);
+	    g_mutex_unlock(&budget.mutex);
+	    break;
+	case PROP_OVER_BUDGET:
+	    addtagmux->over_budget = g_value_get_enum(value);
+	    break;
+	case PROP_PASSTHROUGH:
+	    addtagmux->passthrough = g_value_get_enum(value);
+	    break;
+	case PROP_MERGE_MODE:
+	    addtagmux->merge_mode = g_value_get_enum(value);
+	    break;
+	case PROP_PICTURE_COMMENTS:
+	    addtagmux->picture_comments = g_value_get_boolean(value);
+	    break;
+	case PROP_RESOLVE_URIS:
+	    addtagmux->resolve_uris = g_value_get_boolean(value);
+	    break;
+	case PROP_CACHE_DIRECTORY:
+	    gst_add_tag_mux_disk_set_directory(g_value_get_string(value));
+	    break;
+	case PROP_CACHE_DIRECTORY_MAX_BYTES:
+	    gst_add_tag_mux_disk_set_max_bytes(g_value_get_uint64(value));
+	    break;
+	case PROP_COVER_DIRECTORY:
+	    g_free(addtagmux->cover_directory);
+	    addtagmux->cover_directory = g_value_dup_string(value);
+	    break;
+	case PROP_COVER_PATTERNS:
+	    g_free(addtagmux->cover_patterns);
+	    addtagmux->cover_patterns = g_value_dup_string(value);
+	    break;
+	case PROP_PROBE_DOWNSTREAM:
+	    addtagmux->probe_downstream = g_value_get_boolean(value);
+	    break;
+	default:
+	    G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
+	    break;
+    }
+    g_mutex_unlock(&addtagmux->mutex);
+    GST_TRACE_OBJECT(object, "<");
+}
+
 static void
-gst_add_tag_mux_dispose(
-    GObject *		object)
+gst_add_tag_mux_get_property(
+    GObject *		object,
+    guint		property_id,
+    GValue *		value,
+    GParamSpec *	pspec)
 {
     GST_TRACE_OBJECT(object, ">");
-    // dispose addtagmux
-    G_OBJECT_CLASS(gst_add_tag_mux_parent_class)->dispose(object);
+    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(object);
+    g_mutex_lock(&addtagmux->mutex);
+    switch (property_id) {
+	case PROP_MAX_SIZE_BUFFERS:
+	    g_value_set_uint(value, addtagmux->max_size_buffers);
+	    break;
+	case PROP_MAX_SIZE_BYTES:
+	    g_value_set_uint(value, addtagmux->max_size_bytes);
+	    break;
+	case PROP_MAX_SIZE_TIME:
+	    g_value_set_uint64(value, addtagmux->max_size_time);
+	    break;
+	case PROP_CACHE_MAX_BYTES:
+	    g_value_set_uint64(value, gst_add_tag_mux_cache_get_max_bytes());
+	    break;
+	case PROP_LOCATION:
+	    g_value_set_string(value, addtagmux->location);
+	    break;
+	case PROP_TRUST_CAPS:
+	    g_value_set_boolean(value, addtagmux->trust_caps);
+	    break;
+	case PROP_TIMEOUT:
+	    g_value_set_uint64(value, addtagmux->timeout);
+	    break;
+	case PROP_LATE_TAGS:
+	    g_value_set_boolean(value, addtagmux->late_tags);
+	    break;
+	case PROP_DEDUPE:
+	    g_value_set_boolean(value, addtagmux->dedupe);
+	    break;
+	case PROP_MAX_WIDTH:
+	    g_value_set_uint(value, addtagmux->max_width);
+	    break;
+	case PROP_MAX_HEIGHT:
+	    g_value_set_uint(value, addtagmux->max_height);
+	    break;
+	case PROP_SELECT:
+	    g_value_set_enum(value, addtagmux->select);
+	    break;
+	case PROP_STATS:
+	    g_value_set_boxed(value, addtagmux->stats);
+	    break;
+	case PROP_MAX_BYTES:
+	    g_value_set_uint64(value, addtagmux->max_bytes);
+	    break;
+	case PROP_PROCESS_MAX_BYTES:
+	    g_mutex_lock(&budget.mutex);
+	    g_value_set_uint64(value, budget.max_bytes);
+	    g_mutex_unlock(&budget.mutex);
+	    break;
+	case PROP_OVER_BUDGET:
+	    g_value_set_enum(value, addtagmux->over_budget);
+	    break;
+	case PROP_PASSTHROUGH:
+	    g_value_set_enum(value, addtagmux->passthrough);
+	    break;
+	case PROP_MERGE_MODE:
+	    g_value_set_enum(value, addtagmux->merge_mode);
+	    break;
+	case PROP_PICTURE_COMMENTS:
+	    g_value_set_boolean(value, addtagmux->picture_comments);
+	    break;
+	case PROP_RESOLVE_URIS:
+	    g_value_set_boolean(value, addtagmux->resolve_uris);
+	    break;
+	case PROP_CACHE_DIRECTORY:
+	    g_value_take_string(value, gst_add_tag_mux_disk_get_directory());
+	    break;
+	case PROP_CACHE_DIRECTORY_MAX_BYTES:
+	    g_value_set_uint64(value, gst_add_tag_mux_disk_get_max_bytes());
+	    break;
+	case PROP_COVER_DIRECTORY:
+	    g_value_set_string(value, addtagmux->cover_directory);
+	    break;
+	case PROP_COVER_PATTERNS:
+	    g_value_set_string(value, addtagmux->cover_patterns);
+	    break;
+	case PROP_PROBE_DOWNSTREAM:
+	    g_value_set_boolean(value, addtagmux->probe_downstream);
+	    break;
+	default:
+	    G_OBJECT_WARN_INVALID_PROPERTY_ID(object, property_id, pspec);
+	    break;
+    }
+    g_mutex_unlock(&addtagmux->mutex);
     GST_TRACE_OBJECT(object, "<");
 }
 
-/// GObject finalization for GstAddTagMux
-/// https://developer.gnome.org/gobject/stable/howto-gobject-destruction.html
 static void
-gst_add_tag_mux_finalize(
-    GObject *		object)
+gst_add_tag_mux_class_init(
+    GstAddTagMuxClass *	klass)
 {
-    GST_TRACE_OBJECT(object, ">");
+    GST_TRACE(">");
+    GObjectClass *		gobject_class = G_OBJECT_CLASS(klass);
+    GstElementClass *		element_class = GST_ELEMENT_CLASS(klass);
 
-    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(object);
-    g_cond_clear(&addtagmux->cond);
-    g_mutex_clear(&addtagmux->mutex);
-    if (addtagmux->taglist) {
-	gst_tag_list_unref(addtagmux->taglist);
-    }
+    gst_element_class_set_static_metadata(
+	element_class,
+	"AddTagMux",
+	"Generic",
+	"Mux additional streams as tags",
+	"Ross Tyler");
+
+    // must add REQUEST SINK pad before ALWAYS SINK pad
+    // or else pipeline may not link correctly and issue, for example, a
+    // WARNING: erroneous pipeline: could not link filesrc0 to addtagmux
+    gst_element_class_add_pad_template(element_class,
+	gst_static_pad_template_get(&gst_add_tag_mux_pad_sink_template));
+    gst_element_class_add_pad_template(element_class,
+	gst_static_pad_template_get(&gst_add_tag_mux_sink_template));
+    gst_element_class_add_pad_template(element_class,
+	gst_static_pad_template_get(&gst_add_tag_mux_src_template));
+    // after "sink_%u" so that an additional stream still links to that
+    gst_element_class_add_pad_template(element_class,
+	gst_static_pad_template_get(&gst_add_tag_mux_main_sink_template));
+    gst_element_class_add_pad_template(element_class,
+	gst_static_pad_template_get(&gst_add_tag_mux_main_src_template));
+
+    gobject_class->dispose	= gst_add_tag_mux_dispose;
+    gobject_class->finalize	= gst_add_tag_mux_finalize;
+    gobject_class->set_property	= gst_add_tag_mux_set_property;
+    gobject_class->get_property	= gst_add_tag_mux_get_property;
+
+    g_object_class_install_property(gobject_class, PROP_MAX_SIZE_BUFFERS,
+	g_param_spec_uint("max-size-buffers", "Max. size (buffers)",
+	    "Max. number of main stream buffers held"
+		" while additional streams are pending (0=unlimited)",
+	    0, G_MAXUINT, DEFAULT_MAX_SIZE_BUFFERS,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property(gobject_class, PROP_MAX_SIZE_BYTES,
+	g_param_spec_uint("max-size-bytes", "Max. size (bytes)",
+	    "Max. amount of main stream data held"
+		" while additional streams are pending (0=unlimited)",
+	    0, G_MAXUINT, DEFAULT_MAX_SIZE_BYTES,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property(gobject_class, PROP_MAX_SIZE_TIME,
+	g_param_spec_uint64("max-size-time", "Max. size (ns)",
+	    "Max. amount of main stream time held"
+		" while additional streams are pending (0=unlimited)",
+	    0, G_MAXUINT64, DEFAULT_MAX_SIZE_TIME,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property(gobject_class, PROP_CACHE_MAX_BYTES,
+	g_param_spec_uint64("cache-max-bytes", "Cache max. size (bytes)",
+	    "Max. amount of additional stream samples cached"
+		" for all addtagmux elements in this process (0=disable)",
+	    0, G_MAXUINT64, 0,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property(gobject_class, PROP_LOCATION,
+	g_param_spec_string("location", "Location",
+	    "Image files to add as tags, each [image-type=]path"
+		" (front-cover by default), separated by '"
+		G_SEARCHPATH_SEPARATOR_S "'",
+	    NULL,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class, PROP_TRUST_CAPS,
+	g_param_spec_boolean("trust-caps", "Trust caps",
+	    "Use fixed image caps of additional streams"
+		" instead of typefinding each buffer",
+	    TRUE,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class, PROP_TIMEOUT,
+	g_param_spec_uint64("timeout", "Timeout (ns)",
+	    "Max. time from start to hold the main stream"
+		" for additional streams (0=unlimited)",
+	    0, G_MAXUINT64, 0,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class, PROP_LATE_TAGS,
+	g_param_spec_boolean("late-tags", "Late tags",
+	    "Push tags again for additional streams that end"
+		" after the main stream is released, rather than drop them",
+	    FALSE,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class, PROP_DEDUPE,
+	g_param_spec_boolean("dedupe", "Dedupe",
+	    "Drop an image tag with the same content and image-type"
+		" as one before it",
+	    FALSE,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class, PROP_MAX_WIDTH,
+	g_param_spec_uint("max-width", "Max. width",
+	    "Scale JPEG images down to no wider than this (0=unlimited)",
+	    0, G_MAXUINT, 0,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class, PROP_MAX_HEIGHT,
+	g_param_spec_uint("max-height", "Max. height",
+	    "Scale JPEG images down to no taller than this (0=unlimited)",
+	    0, G_MAXUINT, 0,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class, PROP_SELECT,
+	g_param_spec_enum("select", "Select",
+	    "Keep only one image of each image-type,"
+		" by its size and max-width x max-height",
+	    GST_TYPE_ADD_TAG_MUX_SELECT, GST_ADD_TAG_MUX_SELECT_ALL,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class, PROP_STATS,
+	g_param_spec_boxed("stats", "Statistics",
+	    "Time the main stream waited, time typefinding, bytes"
+		" of each additional stream and of the tags pushed"
+		" on release (NULL before then)",
+	    GST_TYPE_STRUCTURE,
+	    G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property(gobject_class, PROP_MAX_BYTES,
+	g_param_spec_uint64("max-bytes", "Max. size (bytes)",
+	    "Max. amount of images from all additional streams"
+		" held until release (0=unlimited)",
+	    0, G_MAXUINT64, 0,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class, PROP_PROCESS_MAX_BYTES,
+	g_param_spec_uint64("process-max-bytes", "Process max. size (bytes)",
+	    "Max. amount of images held until release"
+		" by all addtagmux elements in this process (0=unlimited)",
+	    0, G_MAXUINT64, 0,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property(gobject_class, PROP_OVER_BUDGET,
+	g_param_spec_enum("over-budget", "Over budget",
+	    "What to do with an image beyond a max-bytes limit",
+	    GST_TYPE_ADD_TAG_MUX_OVER_BUDGET, GST_ADD_TAG_MUX_OVER_BUDGET_DROP,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class, PROP_PASSTHROUGH,
+	g_param_spec_enum("passthrough", "Passthrough",
+	    "Pass the main stream through, without waiting or adding tags,"
+		" when it already has an image of this image-type"
+		" (in its tags or FLAC PICTURE metadata)",
+	    GST_TYPE_TAG_IMAGE_TYPE, GST_TAG_IMAGE_TYPE_NONE,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class, PROP_MERGE_MODE,
+	g_param_spec_enum("merge-mode", "Merge mode",
+	    "How to merge our tags into the first stream tag event"
+		" of the main stream (undefined=push our own)",
+	    GST_TYPE_TAG_MERGE_MODE, GST_TAG_MERGE_UNDEFINED,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class, PROP_PICTURE_COMMENTS,
+	g_param_spec_boolean("picture-comments", "Picture comments",
+	    "Replace image tags with METADATA_BLOCK_PICTURE comments,"
+		" encoded once (and cached), for vorbis comment writers",
+	    FALSE,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class, PROP_RESOLVE_URIS,
+	g_param_spec_boolean("resolve-uris", "Resolve URIs",
+	    "Make images of the local files named by a text/uri-list"
+		" additional stream, in parallel, rather than URL image tags",
+	    FALSE,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class, PROP_CACHE_DIRECTORY,
+	g_param_spec_string("cache-directory", "Cache directory",
+	    "Directory of scaled images cached for all addtagmux elements"
+		" in all processes that use it (NULL=disable)",
+	    NULL,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property(gobject_class,
+	    PROP_CACHE_DIRECTORY_MAX_BYTES,
+	g_param_spec_uint64("cache-directory-max-bytes",
+	    "Cache directory max. size (bytes)",
+	    "Max. amount of scaled images cached in cache-directory",
+	    0, G_MAXUINT64, GST_ADD_TAG_MUX_DISK_DEFAULT_MAX_BYTES,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+    g_object_class_install_property(gobject_class, PROP_COVER_DIRECTORY,
+	g_param_spec_string("cover-directory", "Cover directory",
+	    "Directory (of the main stream's file) in which to find"
+		" image files named as by cover-patterns",
+	    NULL,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class, PROP_COVER_PATTERNS,
+	g_param_spec_string("cover-patterns", "Cover patterns",
+	    "Names of image files to find in cover-directory,"
+		" each [image-type=]glob (front-cover by default),"
+		" in order of preference, separated by '"
+		G_SEARCHPATH_SEPARATOR_S "'",
+	    DEFAULT_COVER_PATTERNS,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+    g_object_class_install_property(gobject_class, PROP_PROBE_DOWNSTREAM,
+	g_param_spec_boolean("probe-downstream", "Probe downstream",
+	    "When the main stream is negotiated, drop additional streams"
+		" (and pass it through) if no tag writer downstream"
+		" keeps images",
+	    FALSE,
+	    G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS
+		| GST_PARAM_MUTABLE_READY));
+
+    element_class->request_new_pad
+	= GST_DEBUG_FUNCPTR(gst_add_tag_mux_request_new_pad);
+    element_class->release_pad
+	= GST_DEBUG_FUNCPTR(gst_add_tag_mux_release_pad);
+    element_class->change_state
+	= GST_DEBUG_FUNCPTR(gst_add_tag_mux_change_state);
 
-    G_OBJECT_CLASS(gst_add_tag_mux_parent_class)->finalize(object);
     GST_TRACE("<");
 }
 
-static GstPad *
-gst_add_tag_mux_request_new_pad(
-    GstElement *	element,
-    GstPadTemplate *	template,
-    gchar const *	name_,
-    GstCaps const *	caps)
+/// Push our tags again if those of late additional streams were added.
+/// Done by the main stream so that they are in order with it.
+static void
+gst_add_tag_mux_push_late(
+    GstAddTagMux *	addtagmux,
+    GstAddTagMuxPair *	pair)
 {
-    GST_TRACE_OBJECT(element, "> name=%s, caps=%" GST_PTR_FORMAT, name_, caps);
-    if (GST_PAD_SINK != template->direction) {
-	GST_ERROR_OBJECT(element, "template not a sink");
-	GST_TRACE_OBJECT(element, "< NULL");
-	return NULL;
+    if (G_LIKELY(!g_atomic_int_get(&pair->late))) {
+	return;
     }
+    GST_TRACE_OBJECT(pair->src, ">");
+    g_mutex_lock(&addtagmux->mutex);
+    g_atomic_int_set(&pair->late, FALSE);
+    GstEvent * event = pair->taglist
+	? gst_event_new_tag(gst_tag_list_ref(pair->taglist))
+	: NULL;
+    g_mutex_unlock(&addtagmux->mutex);
+    if (event) {
+	gst_pad_push_event(pair->src, event);
+    }
+    GST_TRACE_OBJECT(pair->src, "<");
+}
 
-    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(element);
+/// Push our tags (if we still hold them) with the main stream:
+/// after its stream-start, caps and segment events and before anything else
+/// or, with a merge-mode, merged into its first stream tag event.
+/// Returns the event to push in place of the one given (NULL for a buffer).
+static GstEvent *
+gst_add_tag_mux_push_tags(
+    GstAddTagMux *	addtagmux,
+    GstAddTagMuxPair *	pair,
+    GstEvent *		event)
+{
+    if (G_LIKELY(!g_atomic_int_get(&pair->holding))) {
+	return event;
+    }
+    if (event) {
+	switch (GST_EVENT_TYPE(event)) {
+	    case GST_EVENT_STREAM_START:
+	    case GST_EVENT_CAPS:
+	    case GST_EVENT_SEGMENT:
+	    case GST_EVENT_FLUSH_STOP:
+		return event;
+	    default:
+		break;
+	}
+    }
+    GST_TRACE_OBJECT(pair->src, "> %p", event);
     g_mutex_lock(&addtagmux->mutex);
-    gint index = addtagmux->index++;
-    ++addtagmux->count;
+    GstEvent * tags = pair->tags;
+    pair->tags = NULL;
+    g_atomic_int_set(&pair->holding, FALSE);
+    if (tags && event && GST_EVENT_TAG == GST_EVENT_TYPE(event)
+	    && GST_TAG_MERGE_UNDEFINED != addtagmux->merge_mode) {
+	GstTagList * theirs;
+	gst_event_parse_tag(event, &theirs);
+	if (GST_TAG_SCOPE_STREAM == gst_tag_list_get_scope(theirs)) {
+	    GstTagList * ours;
+	    gst_event_parse_tag(tags, &ours);
+	    GstTagList * merged = gst_tag_list_merge(theirs, ours,
+		addtagmux->merge_mode);
+	    gst_tag_list_set_scope(merged, GST_TAG_SCOPE_STREAM);
+	    // late tags and tags after a flush are pushed again with theirs
+	    if (pair->taglist) {
+		gst_tag_list_unref(pair->taglist);
+	    }
+	    pair->taglist = gst_tag_list_ref(merged);
+	    gst_event_unref(event);
+	    gst_event_unref(tags);
+	    tags = NULL;
+	    event = gst_event_new_tag(merged);
+	}
+    }
     g_mutex_unlock(&addtagmux->mutex);
-    gchar * name
-	= g_strdup_printf(GST_PAD_TEMPLATE_NAME_TEMPLATE(template), index);
-    GstPad * pad = g_object_new(GST_TYPE_ADD_TAG_MUX_PAD,
-	// these properties are set *after* object is initialized
-	"name",		name,
-	"direction",	template->direction,
-	"template",	template,
-	NULL);
-    g_free(name);
-    gst_element_add_pad(element, pad);
+    if (tags) {
+	gst_pad_push_event(pair->src, tags);
+    }
+    GST_TRACE_OBJECT(pair->src, "< %p", event);
+    return event;
+}
 
-    GST_TRACE_OBJECT(element, "< %" GST_PTR_FORMAT, pad);
-    return pad;
+/// After a flush (a seek) downstream may start over
+/// so hold our (final) tags to push again with what follows,
+/// as gst_add_tag_mux_wait did, without waiting for anything.
+static void
+gst_add_tag_mux_hold_tags(
+    GstAddTagMux *	addtagmux,
+    GstAddTagMuxPair *	pair)
+{
+    GST_TRACE_OBJECT(pair->src, ">");
+    g_mutex_lock(&addtagmux->mutex);
+    if (!pair->tags && pair->taglist
+	    && !gst_tag_list_is_empty(pair->taglist)) {
+	pair->tags = gst_event_new_tag(gst_tag_list_ref(pair->taglist));
+	g_atomic_int_set(&pair->holding, TRUE);
+    }
+    g_mutex_unlock(&addtagmux->mutex);
+    GST_TRACE_OBJECT(pair->src, "<");
+}
+
+static GstFlowReturn
+gst_add_tag_mux_sink_chain_identity(
+    GstPad *		pad,
+    GstObject *		parent,
+    GstBuffer *		buffer)
+{
+    GST_TRACE_OBJECT(pad, ">");
+    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(parent);
+    GstAddTagMuxPair * pair = gst_pad_get_element_private(pad);
+    gst_add_tag_mux_push_tags(addtagmux, pair, NULL);
+    gst_add_tag_mux_push_late(addtagmux, pair);
+    GstFlowReturn ret = gst_pad_push(pair->src, buffer);
+    GST_TRACE_OBJECT(pad, "< %d", ret);
+    return ret;
+}
+
+static gboolean gst_add_tag_mux_sink_event_identity(
+    GstPad *		pad,
+    GstObject *		parent,
+    GstEvent *		event)
+{
+    GST_TRACE_OBJECT(pad, ">");
+    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(parent);
+    GstAddTagMuxPair * pair = gst_pad_get_element_private(pad);
+    if (GST_EVENT_FLUSH_STOP == GST_EVENT_TYPE(event)) {
+	gst_add_tag_mux_hold_tags(addtagmux, pair);
+    }
+    if (GST_EVENT_IS_SERIALIZED(event)) {
+	event = gst_add_tag_mux_push_tags(addtagmux, pair, event);
+    }
+    if (GST_EVENT_EOS == GST_EVENT_TYPE(event)) {
+	gst_add_tag_mux_push_late(addtagmux, pair);
+    }
+    gboolean ret = gst_pad_push_event(pair->src, event);
+    GST_TRACE_OBJECT(pad, "< %d", ret);
+    return ret;
+}
+
+static GstFlowReturn
+gst_add_tag_mux_src_getrange_identity(
+    GstPad *		pad,
+    GstObject *		parent,
+    guint64		offset,
+    guint		length,
+    GstBuffer **	buffer)
+{
+    GST_TRACE_OBJECT(pad, ">");
+    // our sink pad was activated in pull mode with us and pulls from its peer.
+    // tags we hold, or late tags, go downstream before the range
+    // as they would before a pushed buffer
+    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(parent);
+    GstAddTagMuxPair * pair = gst_pad_get_element_private(pad);
+    gst_add_tag_mux_push_tags(addtagmux, pair, NULL);
+    gst_add_tag_mux_push_late(addtagmux, pair);
+    GstFlowReturn ret = gst_pad_pull_range(pair->sink, offset, length, buffer);
+    GST_TRACE_OBJECT(pad, "< %d", ret);
+    return ret;
+}
+
+/// Activating our src pad in pull mode activates our sink pad (and its peer)
+/// in pull mode, so that we can pull through it.
+static gboolean
+gst_add_tag_mux_src_activate_mode(
+    GstPad *		pad,
+    GstObject *		parent,
+    GstPadMode		mode,
+    gboolean		active)
+{
+    GST_TRACE_OBJECT(pad, "> %d %d", mode, active);
+    gboolean ret = TRUE;
+    if (GST_PAD_MODE_PULL == mode) {
+	GstAddTagMuxPair * pair = gst_pad_get_element_private(pad);
+	ret = gst_pad_activate_mode(pair->sink, mode, active);
+    }
+    GST_TRACE_OBJECT(pad, "< %d", ret);
+    return ret;
+}
+
+/// Forget what is held in our queue.
+/// On flush, sticky events (other than EOS) are kept
+/// as they must still precede whatever follows downstream.
+/// Called with the mutex held.
+static void
+gst_add_tag_mux_queue_clear(
+    GstAddTagMuxPair *	pair,
+    gboolean		keep_sticky)
+{
+    GQueue queue = pair->queue;
+    g_queue_init(&pair->queue);
+    GstMiniObject * object;
+    while ((object = g_queue_pop_head(&queue))) {
+	if (keep_sticky && GST_IS_EVENT(object)
+		&& GST_EVENT_IS_STICKY(GST_EVENT_CAST(object))
+		&& GST_EVENT_EOS != GST_EVENT_TYPE(GST_EVENT_CAST(object))) {
+	    g_queue_push_tail(&pair->queue, object);
+	} else {
+	    gst_mini_object_unref(object);
+	}
+    }
+    pair->queue_buffers = 0;
+    pair->queue_bytes = 0;
+    pair->queue_first = GST_CLOCK_TIME_NONE;
+    pair->queue_last = GST_CLOCK_TIME_NONE;
+}
+
+/// Hold a main stream buffer or serialized event in our queue
+/// if additional streams are pending and the queue is not yet full.
+/// Otherwise, hold nothing and return FALSE.
+static gboolean
+gst_add_tag_mux_enqueue(
+    GstAddTagMux *	addtagmux,
+    GstAddTagMuxPair *	pair,
+    GstMiniObject *	object)
+{
+    GST_TRACE_OBJECT(pair->sink, ">");
+    g_mutex_lock(&addtagmux->mutex);
+    GstClockTime time = 0;
+    if (GST_CLOCK_TIME_IS_VALID(pair->queue_first)
+	    && pair->queue_last > pair->queue_first) {
+	time = pair->queue_last - pair->queue_first;
+    }
+    gboolean ret = !addtagmux->released && addtagmux->count && !pair->flushing
+	&& !(addtagmux->deadline
+	    && g_get_monotonic_time() >= addtagmux->deadline)
+	&& !(addtagmux->max_size_buffers
+	    && pair->queue_buffers >= addtagmux->max_size_buffers)
+	&& !(addtagmux->max_size_bytes
+	    && pair->queue_bytes >= addtagmux->max_size_bytes)
+	&& !(addtagmux->max_size_time
+	    && time >= addtagmux->max_size_time);
+    if (ret) {
+	if (GST_IS_BUFFER(object)) {
+	    GstBuffer * buffer = GST_BUFFER_CAST(object);
+	    ++pair->queue_buffers;
+	    pair->queue_bytes += gst_buffer_get_size(buffer);
+	    GstClockTime t = GST_BUFFER_DTS_OR_PTS(buffer);
+	    if (GST_CLOCK_TIME_IS_VALID(t)) {
+		if (!GST_CLOCK_TIME_IS_VALID(pair->queue_first)) {
+		    pair->queue_first = t;
+		}
+		pair->queue_last = t;
+	    }
+	}
+	g_queue_push_tail(&pair->queue, object);
+	GST_LOG_OBJECT(pair->sink, "queued %u buffers, %" G_GUINT64_FORMAT
+	    " bytes, %" GST_TIME_FORMAT,
+	    pair->queue_buffers, pair->queue_bytes,
+	    GST_TIME_ARGS(time));
+    }
+    g_mutex_unlock(&addtagmux->mutex);
+    GST_TRACE_OBJECT(pair->sink, "< %d", ret);
+    return ret;
+}
+
+/// Whether tags have an image of an image-type
+static gboolean
+gst_add_tag_mux_has_image(
+    GstTagList const *	taglist,
+    GstTagImageType	image_type)
+{
+    guint i, n = gst_tag_list_get_tag_size(taglist, GST_TAG_IMAGE);
+    for (i = 0; i < n; ++i) {
+	GstSample * sample;
+	if (gst_tag_list_get_sample_index(taglist, GST_TAG_IMAGE, i, &sample)) {
+	    gboolean has
+		= image_type == gst_add_tag_mux_sample_image_type(sample);
+	    gst_sample_unref(sample);
+	    if (has) {
+		return TRUE;
+	    }
+	}
+    }
+    return FALSE;
+}
+
+/// The main stream already has the image we would add.
+/// Drop our additional streams (and whatever tags we have)
+/// so that it need not wait for them.
+static void
+gst_add_tag_mux_passthrough(
+    GstAddTagMux *	addtagmux)
+{
+    GST_TRACE_OBJECT(addtagmux, ">");
+    GList * kept = NULL;
+    GST_OBJECT_LOCK(addtagmux);
+    g_mutex_lock(&addtagmux->mutex);
+    if (!addtagmux->released) {
+	GST_INFO_OBJECT(addtagmux, "passthrough");
+	addtagmux->passed = TRUE;
+	GList * link;
+	for (link = GST_ELEMENT(addtagmux)->sinkpads; link;
+		link = link->next) {
+	    if (GST_IS_ADD_TAG_MUX_PAD(link->data)) {
+		GstAddTagMuxPad * addtagmuxpad
+		    = GST_ADD_TAG_MUX_PAD(link->data);
+		// a stream that has ended (or never started)
+		// no longer writes what it made so we discard it now.
+		// what a pending one made its own thread discards
+		gboolean settled = !addtagmuxpad->pending
+		    && !addtagmuxpad->dropped;
+		gst_add_tag_mux_pad_drop(addtagmuxpad, addtagmux);
+		addtagmuxpad->dropped = TRUE;
+		if (settled) {
+		    gst_add_tag_mux_pad_discard(addtagmuxpad, addtagmux);
+		}
+	    }
+	}
+	// as are those released after they ended
+	kept = addtagmux->kept;
+	addtagmux->kept = NULL;
+	for (link = kept; link; link = link->next) {
+	    gst_add_tag_mux_pad_discharge(link->data, addtagmux);
+	}
+	gst_tag_list_unref(addtagmux->taglist);
+	addtagmux->taglist = gst_tag_list_new_empty();
+    }
+    g_mutex_unlock(&addtagmux->mutex);
+    GST_OBJECT_UNLOCK(addtagmux);
+    g_list_free_full(kept, gst_object_unref);
+    GST_TRACE_OBJECT(addtagmux, "<");
+}
+
+/// Tag writers (by factory name) that keep no images
+static gchar const * const imageless_writers[] = {
+    "wavenc",
+    "apev2mux",
+    NULL,
+};
+
+/// Whether a tag writer that keeps images is downstream of a src pad.
+/// Follow internal links (through ghost pads, tees, encoders and muxers)
+/// until a tag writer or a sink.
+/// What we cannot see past (an unlinked pad or an element with no src pads
+/// yet) might keep images.
+static gboolean
+gst_add_tag_mux_keeps_images(
+    GstPad *		pad,
+    guint		depth)
+{
+    GstPad * peer = gst_pad_get_peer(pad);
+    if (!peer || 32 < depth) {
+	if (peer) {
+	    gst_object_unref(peer);
+	}
+	return TRUE;
+    }
+    gboolean ret = FALSE;
+    GstElement * element = gst_pad_get_parent_element(peer);
+    if (element && GST_IS_TAG_SETTER(element)) {
+	GstElementFactory * factory = gst_element_get_factory(element);
+	gchar const * name = factory ? GST_OBJECT_NAME(factory) : "";
+	ret = !g_strv_contains(imageless_writers, name);
+	GST_DEBUG_OBJECT(pad, "%" GST_PTR_FORMAT " %d", element, ret);
+    } else {
+	gboolean linked = FALSE;
+	GstIterator * iterator = gst_pad_iterate_internal_links(peer);
+	GValue item = G_VALUE_INIT;
+	gboolean done = !iterator;
+	while (!done) {
+	    switch (gst_iterator_next(iterator, &item)) {
+		case GST_ITERATOR_OK:
+		    linked = TRUE;
+		    if (gst_add_tag_mux_keeps_images(g_value_get_object(&item),
+			    depth + 1)) {
+			ret = done = TRUE;
+		    }
+		    g_value_reset(&item);
+		    break;
+		case GST_ITERATOR_RESYNC:
+		    gst_iterator_resync(iterator);
+		    linked = FALSE;
+		    break;
+		default:
+		    done = TRUE;
+		    break;
+	    }
+	}
+	g_value_unset(&item);
+	if (iterator) {
+	    gst_iterator_free(iterator);
+	}
+	if (!linked) {
+	    // the end of the line, unless we cannot see past it
+	    ret = !element || GST_IS_BIN(element)
+		|| !GST_OBJECT_FLAG_IS_SET(element, GST_ELEMENT_FLAG_SINK);
+	    GST_DEBUG_OBJECT(pad, "%" GST_PTR_FORMAT " %d", element, ret);
+	}
+    }
+    if (element) {
+	gst_object_unref(element);
+    }
+    gst_object_unref(peer);
+    return ret;
+}
+
+/// Once negotiated, see if a tag writer downstream of a main stream
+/// would keep our images.
+/// When none downstream of any main stream would,
+/// drop our additional streams as for passthrough.
+static void
+gst_add_tag_mux_probe_downstream(
+    GstAddTagMux *	addtagmux,
+    GstAddTagMuxPair *	pair)
+{
+    GST_TRACE_OBJECT(pair->src, ">");
+    gboolean keeps_images = gst_add_tag_mux_keeps_images(pair->src, 0);
+    g_mutex_lock(&addtagmux->mutex);
+    pair->probed = TRUE;
+    pair->keeps_images = keeps_images;
+    gboolean drop = !addtagmux->released;
+    GList * link;
+    for (link = addtagmux->pairs; drop && link; link = link->next) {
+	GstAddTagMuxPair * other = link->data;
+	drop = other->probed && !other->keeps_images;
+    }
+    g_mutex_unlock(&addtagmux->mutex);
+    if (drop) {
+	GST_INFO_OBJECT(addtagmux, "no images kept downstream");
+	gst_add_tag_mux_passthrough(addtagmux);
+    }
+    GST_TRACE_OBJECT(pair->src, "< %d", keeps_images);
+}
+
+/// Scan the start of the main stream (FLAC) for the image we would add
+static void
+gst_add_tag_mux_scan(
+    GstAddTagMux *	addtagmux,
+    GstAddTagMuxPair *	pair,
+    GstBuffer *		buffer)
+{
+    GstMapInfo map;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+	return;
+    }
+    GstAddTagMuxFlacScanResult result = gst_add_tag_mux_flac_scan(
+	&pair->flac_scan, map.data, map.size, addtagmux->passthrough);
+    gst_buffer_unmap(buffer, &map);
+    if (GST_ADD_TAG_MUX_FLAC_SCAN_MORE != result) {
+	GST_DEBUG_OBJECT(pair->sink, "scanned %d", result);
+	pair->scanning = FALSE;
+	if (GST_ADD_TAG_MUX_FLAC_SCAN_FOUND == result) {
+	    gst_add_tag_mux_passthrough(addtagmux);
+	}
+    }
+}
+
+/// Order pads by descending priority, then by the order they were requested
+static gint
+gst_add_tag_mux_pad_compare_priority(
+    gconstpointer	a,
+    gconstpointer	b)
+{
+    gint pa = GST_ADD_TAG_MUX_PAD(a)->priority;
+    gint pb = GST_ADD_TAG_MUX_PAD(b)->priority;
+    if (pa != pb) {
+	return pa < pb ? 1 : -1;
+    }
+    gint ia = GST_ADD_TAG_MUX_PAD(a)->index;
+    gint ib = GST_ADD_TAG_MUX_PAD(b)->index;
+    return ia < ib ? -1 : ia > ib ? 1 : 0;
 }
 
+/// Add the size of the image (sample) buffers and strings of a tag
+/// to a count of bytes
 static void
-gst_add_tag_mux_release_pad(
-    GstElement *	element,
-    GstPad *		pad)
+gst_add_tag_mux_count_tag_bytes(
+    GstTagList const *	taglist,
+    gchar const *	tag,
+    gpointer		user_data)
 {
-    GST_TRACE_OBJECT(element, ">");
-    GST_TRACE_OBJECT(element, "<");
+    guint64 * bytes = user_data;
+    guint i, n = gst_tag_list_get_tag_size(taglist, tag);
+    for (i = 0; i < n; ++i) {
+	GValue const * value = gst_tag_list_get_value_index(taglist, tag, i);
+	if (GST_VALUE_HOLDS_SAMPLE(value)) {
+	    GstBuffer * buffer
+		= gst_sample_get_buffer(gst_value_get_sample(value));
+	    if (buffer) {
+		*bytes += gst_buffer_get_size(buffer);
+	    }
+	} else if (G_VALUE_HOLDS_STRING(value) && g_value_get_string(value)) {
+	    *bytes += strlen(g_value_get_string(value));
+	}
+    }
 }
 
-/// A "sink_%u" SINK pad exists only on REQUEST
-/// and only supports streams that we can turn into tags
-static GstStaticPadTemplate gst_add_tag_mux_pad_sink_template =
-GST_STATIC_PAD_TEMPLATE(
-    "sink_%u",
-    GST_PAD_SINK,
-    GST_PAD_REQUEST,
-    GST_STATIC_CAPS(
-	"image/jpeg;"
-	"image/png;"
-	"text/uri-list")
-);
-
-/// Our "sink" SINK pad ALWAYS exists and supports ANYthing
-static GstStaticPadTemplate gst_add_tag_mux_sink_template =
-GST_STATIC_PAD_TEMPLATE(
-    "sink",
-    GST_PAD_SINK,
-    GST_PAD_ALWAYS,
-    GST_STATIC_CAPS_ANY
-);
-
-/// Our "src" SRC pad ALWAYS exists and supports ANYthing
-static GstStaticPadTemplate gst_add_tag_mux_src_template =
-GST_STATIC_PAD_TEMPLATE(
-    "src",
-    GST_PAD_SRC,
-    GST_PAD_ALWAYS,
-    GST_STATIC_CAPS_ANY
-);
-
+/// Add what an additional stream has done, by pad name, to stats.
+/// Called with the mutex held.
 static void
-gst_add_tag_mux_class_init(
-    GstAddTagMuxClass *	klass)
+gst_add_tag_mux_pad_stats(
+    GstAddTagMuxPad *	addtagmuxpad,
+    GstStructure *	stats)
 {
-    GST_TRACE(">");
-    GObjectClass *		gobject_class = G_OBJECT_CLASS(klass);
-    GstElementClass *		element_class = GST_ELEMENT_CLASS(klass);
-
-    gst_element_class_set_static_metadata(
-	element_class,
-	"AddTagMux",
-	"Generic",
-	"Mux additional streams as tags",
-	"Ross Tyler");
-
-    // must add REQUEST SINK pad before ALWAYS SINK pad
-    // or else pipeline may not link correctly and issue, for example, a
-    // WARNING: erroneous pipeline: could not link filesrc0 to addtagmux
-    gst_element_class_add_pad_template(element_class,
-	gst_static_pad_template_get(&gst_add_tag_mux_pad_sink_template));
-    gst_element_class_add_pad_template(element_class,
-	gst_static_pad_template_get(&gst_add_tag_mux_sink_template));
-    gst_element_class_add_pad_template(element_class,
-	gst_static_pad_template_get(&gst_add_tag_mux_src_template));
-
-    gobject_class->dispose	= gst_add_tag_mux_dispose;
-    gobject_class->finalize	= gst_add_tag_mux_finalize;
-
-    element_class->request_new_pad
-	= GST_DEBUG_FUNCPTR(gst_add_tag_mux_request_new_pad);
-    element_class->release_pad
-	= GST_DEBUG_FUNCPTR(gst_add_tag_mux_release_pad);
-
-    GST_TRACE("<");
+    GstStructure * s = gst_structure_new("pad",
+	"state", G_TYPE_STRING, addtagmuxpad->pending ? "late"
+	    : addtagmuxpad->dropped ? "dropped" : "ended",
+	"bytes", G_TYPE_UINT64, addtagmuxpad->bytes,
+	"typefind-time", G_TYPE_UINT64, addtagmuxpad->typefind_time,
+	"held-bytes", G_TYPE_UINT64, (guint64) addtagmuxpad->held_bytes,
+	NULL);
+    gst_structure_set(stats, GST_PAD_NAME(addtagmuxpad),
+	GST_TYPE_STRUCTURE, s,
+	NULL);
+    gst_structure_free(s);
 }
 
-static GstFlowReturn
-gst_add_tag_mux_sink_chain_identity(
-    GstPad *		pad,
-    GstObject *		parent,
-    GstBuffer *		buffer)
+/// A main stream takes (a share of) our released taglist
+/// and returns an event to push it (or NULL, if it has no tags).
+/// Our taglist is now immutable (copied if changed)
+/// so that each may push it again after a flush or add late tags to it.
+/// Called with the mutex held.
+static GstEvent *
+gst_add_tag_mux_pair_take(
+    GstAddTagMux *	addtagmux,
+    GstAddTagMuxPair *	pair)
 {
-    GST_TRACE_OBJECT(pad, ">");
-    GstFlowReturn ret = gst_pad_push(GST_ADD_TAG_MUX(parent)->src, buffer);
-    GST_TRACE_OBJECT(pad, "< %d", ret);
-    return ret;
+    pair->released = TRUE;
+    if (!addtagmux->taglist || gst_tag_list_is_empty(addtagmux->taglist)) {
+	return NULL;
+    }
+    pair->taglist = gst_tag_list_ref(addtagmux->taglist);
+    return gst_event_new_tag(gst_tag_list_ref(addtagmux->taglist));
 }
 
-static gboolean gst_add_tag_mux_sink_event_identity(
-    GstPad *		pad,
-    GstObject *		parent,
-    GstEvent *		event)
+/// Merge the tags of each additional stream that has ended into ours
+/// and return an event to push them (or NULL, if there are none).
+/// This is done once, by the first main stream to be released;
+/// the others share what it did (and get no stats).
+/// Our pads, and those released after they ended, are sorted by priority
+/// and then by the order they were requested
+/// so the result is the same no matter which stream ended first.
+/// Those still pending are late; they stop now unless we push late-tags.
+/// What it all took is returned in (a copy of our) stats.
+static GstEvent *
+gst_add_tag_mux_release_tags(
+    GstAddTagMux *	addtagmux,
+    GstAddTagMuxPair *	pair,
+    GstStructure **	stats)
 {
-    GST_TRACE_OBJECT(pad, ">");
-    gboolean ret = gst_pad_push_event(GST_ADD_TAG_MUX(parent)->src, event);
-    GST_TRACE_OBJECT(pad, "< %d", ret);
-    return ret;
+    GST_TRACE_OBJECT(addtagmux, ">");
+    GST_OBJECT_LOCK(addtagmux);
+    g_mutex_lock(&addtagmux->mutex);
+    if (addtagmux->released) {
+	// by another main stream, once it is finished
+	GST_OBJECT_UNLOCK(addtagmux);
+	gst_add_tag_mux_finishing_wait(addtagmux);
+	*stats = NULL;
+	GstEvent * event = gst_add_tag_mux_pair_take(addtagmux, pair);
+	g_mutex_unlock(&addtagmux->mutex);
+	GST_TRACE_OBJECT(addtagmux, "< %p", event);
+	return event;
+    }
+    addtagmux->released = TRUE;
+    addtagmux->finishing = TRUE;
+    guint64 held_bytes = addtagmux->held_bytes;
+    GstStructure * pad_stats = gst_structure_new_empty("pads");
+    GstClockTime typefind_time = 0;
+    GList * pads = NULL;
+    GList * link;
+    for (link = GST_ELEMENT(addtagmux)->sinkpads; link; link = link->next) {
+	if (!GST_IS_ADD_TAG_MUX_PAD(link->data)) {
+	    continue;
+	}
+	GstAddTagMuxPad * addtagmuxpad = GST_ADD_TAG_MUX_PAD(link->data);
+	gst_add_tag_mux_pad_stats(addtagmuxpad, pad_stats);
+	typefind_time += addtagmuxpad->typefind_time;
+	if (addtagmuxpad->pending) {
+	    GST_INFO_OBJECT(addtagmuxpad, "late");
+	    if (!addtagmux->late_tags) {
+		gst_pad_set_chain_function(GST_PAD(addtagmuxpad),
+		    GST_DEBUG_FUNCPTR(gst_add_tag_mux_pad_sink_chain_eos));
+	    }
+	} else if (!addtagmuxpad->dropped) {
+	    if (addtagmuxpad->taglist) {
+		pads = g_list_prepend(pads, addtagmuxpad);
+	    }
+	    // what is merged is given away below (or kept for late tags)
+	    gst_add_tag_mux_pad_discharge(addtagmuxpad, addtagmux);
+	}
+	// what a dropped stream made is its own thread's to discard
+    }
+    GList * kept = addtagmux->kept;
+    addtagmux->kept = NULL;
+    for (link = kept; link; link = link->next) {
+	GstAddTagMuxPad * addtagmuxpad = GST_ADD_TAG_MUX_PAD(link->data);
+	gst_add_tag_mux_pad_stats(addtagmuxpad, pad_stats);
+	typefind_time += addtagmuxpad->typefind_time;
+	pads = g_list_prepend(pads, addtagmuxpad);
+	gst_add_tag_mux_pad_discharge(addtagmuxpad, addtagmux);
+    }
+    pads = g_list_sort(pads, gst_add_tag_mux_pad_compare_priority);
+    for (link = pads; link; link = link->next) {
+	GstAddTagMuxPad * addtagmuxpad = GST_ADD_TAG_MUX_PAD(link->data);
+	gst_tag_list_insert(addtagmux->taglist, addtagmuxpad->taglist,
+	    GST_TAG_MERGE_APPEND);
+	gst_tag_list_unref(addtagmuxpad->taglist);
+	addtagmuxpad->taglist = NULL;
+    }
+    g_list_free(pads);
+
+    // finish what we merged without our locks
+    // while other main streams wait for it
+    GstTagList * taglist = addtagmux->taglist;
+    addtagmux->taglist = NULL;
+    g_mutex_unlock(&addtagmux->mutex);
+    GST_OBJECT_UNLOCK(addtagmux);
+    g_list_free_full(kept, gst_object_unref);
+    guint64 tag_bytes = 0;
+    guint tags = 0;
+    if (taglist) {
+	gst_add_tag_mux_finish_tags(addtagmux, taglist);
+	gst_tag_list_foreach(taglist,
+	    gst_add_tag_mux_count_tag_bytes, &tag_bytes);
+	tags = gst_tag_list_n_tags(taglist);
+    }
+
+    g_mutex_lock(&addtagmux->mutex);
+    addtagmux->taglist = taglist;
+    addtagmux->finishing = FALSE;
+    g_cond_broadcast(&addtagmux->cond);
+    if (addtagmux->stats) {
+	gst_structure_free(addtagmux->stats);
+    }
+    addtagmux->stats = gst_structure_new("addtagmux-stats",
+	"wait-time", G_TYPE_UINT64, addtagmux->wait_time,
+	"typefind-time", G_TYPE_UINT64, typefind_time,
+	"tags", G_TYPE_UINT, tags,
+	"tag-bytes", G_TYPE_UINT64, tag_bytes,
+	"held-bytes", G_TYPE_UINT64, held_bytes,
+	"over-budget", G_TYPE_UINT, addtagmux->over_budget_images,
+	"passthrough", G_TYPE_BOOLEAN, addtagmux->passed,
+	"pads", GST_TYPE_STRUCTURE, pad_stats,
+	NULL);
+    gst_structure_free(pad_stats);
+    *stats = gst_structure_copy(addtagmux->stats);
+
+    GstEvent * event = gst_add_tag_mux_pair_take(addtagmux, pair);
+    g_mutex_unlock(&addtagmux->mutex);
+    GST_TRACE_OBJECT(addtagmux, "< %p", event);
+    return event;
 }
 
-static GstFlowReturn
-gst_add_tag_mux_src_getrange_identity(
-    GstPad *		pad,
-    GstObject *		parent,
-    guint64		offset,
-    guint		length,
-    GstBuffer **	buffer)
+/// Start or stop flushing a main stream.
+/// Starting releases a main stream blocked in gst_add_tag_mux_wait.
+static void
+gst_add_tag_mux_flush(
+    GstAddTagMux *	addtagmux,
+    GstAddTagMuxPair *	pair,
+    gboolean		flushing)
 {
-    GST_TRACE_OBJECT(pad, ">");
-    GstPad * peer = gst_pad_get_peer(GST_ADD_TAG_MUX(parent)->sink);
-    GstFlowReturn ret = gst_pad_pull_range(peer, offset, length, buffer);
-    gst_object_unref(peer);
-    GST_TRACE_OBJECT(pad, "< %d", ret);
-    return ret;
+    GST_TRACE_OBJECT(pair->sink, "> %d", flushing);
+    g_mutex_lock(&addtagmux->mutex);
+    pair->flushing = flushing;
+    if (flushing) {
+	g_cond_broadcast(&addtagmux->cond);
+    } else {
+	gst_add_tag_mux_queue_clear(pair, TRUE);
+    }
+    g_mutex_unlock(&addtagmux->mutex);
+    GST_TRACE_OBJECT(pair->sink, "<");
 }
 
-static gboolean
+static GstFlowReturn
 gst_add_tag_mux_wait(
-    GstAddTagMux *	addtagmux)
+    GstAddTagMux *	addtagmux,
+    GstAddTagMuxPair *	pair)
 {
-    GST_TRACE_OBJECT(addtagmux, ">");
+    GST_TRACE_OBJECT(pair->sink, ">");
 
-    // wait while there are additional pads still streaming
+    // wait while there are required additional pads still streaming
+    // or until our deadline, unless another main stream was released
+    gint64 start = g_get_monotonic_time();
     g_mutex_lock(&addtagmux->mutex);
-    while (addtagmux->count) {
-	GST_DEBUG_OBJECT(addtagmux, "wait %d", addtagmux->count);
-	g_cond_wait(&addtagmux->cond, &addtagmux->mutex);
+    while (!addtagmux->released && addtagmux->count && addtagmux->required
+	    && !pair->flushing) {
+	GST_DEBUG_OBJECT(addtagmux, "wait %d %d",
+	    addtagmux->count, addtagmux->required);
+	if (!addtagmux->deadline) {
+	    g_cond_wait(&addtagmux->cond, &addtagmux->mutex);
+	} else if (!g_cond_wait_until(&addtagmux->cond, &addtagmux->mutex,
+		addtagmux->deadline)) {
+	    GST_INFO_OBJECT(addtagmux, "timeout %d", addtagmux->count);
+	    break;
+	}
+    }
+    if (pair->flushing) {
+	g_mutex_unlock(&addtagmux->mutex);
+	GST_TRACE_OBJECT(pair->sink, "< FLUSHING");
+	return GST_FLOW_FLUSHING;
     }
+    if (!addtagmux->released) {
+	addtagmux->wait_time = (g_get_monotonic_time() - start) * GST_USECOND;
+    }
+
+    // take what we have queued
+    GQueue queue = pair->queue;
+    g_queue_init(&pair->queue);
+    gst_add_tag_mux_queue_clear(pair, FALSE);
     g_mutex_unlock(&addtagmux->mutex);
 
-    // push our taglist as an event downstream if it has any tags
-    gboolean ret;
-    if (gst_tag_list_is_empty(addtagmux->taglist)) {
-	ret = TRUE;
-    } else {
-	GstEvent * event = gst_event_new_tag(addtagmux->taglist);
-	addtagmux->taglist = 0;		// transferred to event
-	ret = gst_pad_push_event(addtagmux->src, event);
+    // hold our taglist as an event, if it has any tags,
+    // to push with the main stream
+    // and tell the application what it took
+    GstStructure * stats;
+    GstEvent * event = gst_add_tag_mux_release_tags(addtagmux, pair, &stats);
+    if (stats) {
+	GST_INFO_OBJECT(addtagmux, "%" GST_PTR_FORMAT, stats);
+	gst_element_post_message(GST_ELEMENT(addtagmux),
+	    gst_message_new_element(GST_OBJECT(addtagmux), stats));
+    }
+    if (event) {
+	g_mutex_lock(&addtagmux->mutex);
+	pair->tags = event;
+	g_atomic_int_set(&pair->holding, TRUE);
+	g_mutex_unlock(&addtagmux->mutex);
+    }
+
+    // push what we have queued.
+    // after a flow error, queued buffers are dropped but events still go
+    GstFlowReturn ret = GST_FLOW_OK;
+    GstMiniObject * object;
+    while ((object = g_queue_pop_head(&queue))) {
+	if (GST_IS_BUFFER(object)) {
+	    if (GST_FLOW_OK == ret) {
+		gst_add_tag_mux_push_tags(addtagmux, pair, NULL);
+		ret = gst_pad_push(pair->src, GST_BUFFER_CAST(object));
+	    } else {
+		gst_mini_object_unref(object);
+	    }
+	} else {
+	    gst_pad_push_event(pair->src, gst_add_tag_mux_push_tags(
+		addtagmux, pair, GST_EVENT_CAST(object)));
+	}
     }
 
     // use *_identity transforms/methods from now on
-    gst_pad_set_chain_function(addtagmux->sink,
+    gst_pad_set_chain_function(pair->sink,
 	GST_DEBUG_FUNCPTR(gst_add_tag_mux_sink_chain_identity));
-    gst_pad_set_event_function(addtagmux->sink,
+    gst_pad_set_event_function(pair->sink,
 	GST_DEBUG_FUNCPTR(gst_add_tag_mux_sink_event_identity));
-    gst_pad_set_getrange_function(addtagmux->src,
+    gst_pad_set_query_function(pair->sink,
+	GST_DEBUG_FUNCPTR(gst_pad_query_default));
+    gst_pad_set_getrange_function(pair->src,
 	GST_DEBUG_FUNCPTR(gst_add_tag_mux_src_getrange_identity));
 
-    GST_TRACE_OBJECT(addtagmux, "<");
+    GST_TRACE_OBJECT(pair->sink, "< %d", ret);
     return ret;
 }
 
@@ -512,9 +3838,20 @@ gst_add_tag_mux_sink_chain_wait(
     GstBuffer *		buffer)
 {
     GST_TRACE_OBJECT(pad, ">");
-    gst_add_tag_mux_wait(GST_ADD_TAG_MUX(parent));
-    GstFlowReturn ret = gst_add_tag_mux_sink_chain_identity(
-	pad, parent, buffer);
+    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(parent);
+    GstAddTagMuxPair * pair = gst_pad_get_element_private(pad);
+    if (pair->scanning) {
+	gst_add_tag_mux_scan(addtagmux, pair, buffer);
+    }
+    GstFlowReturn ret;
+    if (gst_add_tag_mux_enqueue(addtagmux, pair,
+	    GST_MINI_OBJECT_CAST(buffer))) {
+	ret = GST_FLOW_OK;
+    } else if (GST_FLOW_OK == (ret = gst_add_tag_mux_wait(addtagmux, pair))) {
+	ret = gst_add_tag_mux_sink_chain_identity(pad, parent, buffer);
+    } else {
+	gst_buffer_unref(buffer);
+    }
     GST_TRACE_OBJECT(pad, "< %d", ret);
     return ret;
 }
@@ -525,12 +3862,70 @@ static gboolean gst_add_tag_mux_sink_event_wait(
     GstEvent *		event)
 {
     GST_TRACE_OBJECT(pad, ">");
-    gst_add_tag_mux_wait(GST_ADD_TAG_MUX(parent));
+    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(parent);
+    GstAddTagMuxPair * pair = gst_pad_get_element_private(pad);
+    if (GST_EVENT_CAPS == GST_EVENT_TYPE(event)
+	    && addtagmux->probe_downstream && !pair->probed) {
+	gst_add_tag_mux_probe_downstream(addtagmux, pair);
+    }
+    switch (GST_EVENT_TYPE(event)) {
+	case GST_EVENT_FLUSH_START:
+	    gst_add_tag_mux_flush(addtagmux, pair, TRUE);
+	    break;
+	case GST_EVENT_FLUSH_STOP:
+	    gst_add_tag_mux_flush(addtagmux, pair, FALSE);
+	    break;
+	case GST_EVENT_TAG:
+	    if (GST_TAG_IMAGE_TYPE_NONE != addtagmux->passthrough) {
+		GstTagList * taglist;
+		gst_event_parse_tag(event, &taglist);
+		if (gst_add_tag_mux_has_image(taglist,
+			addtagmux->passthrough)) {
+		    gst_add_tag_mux_passthrough(addtagmux);
+		}
+	    }
+	    // fall through
+	default:
+	    if (!GST_EVENT_IS_SERIALIZED(event)) {
+		break;
+	    }
+	    // hold serialized events in order with buffers.
+	    // nothing follows EOS to release it so it is not held
+	    if (GST_EVENT_EOS != GST_EVENT_TYPE(event)
+		    && gst_add_tag_mux_enqueue(addtagmux, pair,
+			GST_MINI_OBJECT_CAST(event))) {
+		GST_TRACE_OBJECT(pad, "< TRUE");
+		return TRUE;
+	    }
+	    if (GST_FLOW_OK != gst_add_tag_mux_wait(addtagmux, pair)) {
+		gst_event_unref(event);
+		GST_TRACE_OBJECT(pad, "< FALSE");
+		return FALSE;
+	    }
+	    break;
+    }
     gboolean ret = gst_add_tag_mux_sink_event_identity(pad, parent, event);
     GST_TRACE_OBJECT(pad, "< %d", ret);
     return ret;
 }
 
+static gboolean gst_add_tag_mux_sink_query_wait(
+    GstPad *		pad,
+    GstObject *		parent,
+    GstQuery *		query)
+{
+    GST_TRACE_OBJECT(pad, ">");
+    // a serialized query must not overtake what we hold
+    gboolean ret = !GST_QUERY_IS_SERIALIZED(query)
+	|| GST_FLOW_OK == gst_add_tag_mux_wait(GST_ADD_TAG_MUX(parent),
+	    gst_pad_get_element_private(pad));
+    if (ret) {
+	ret = gst_pad_query_default(pad, parent, query);
+    }
+    GST_TRACE_OBJECT(pad, "< %d", ret);
+    return ret;
+}
+
 static GstFlowReturn
 gst_add_tag_mux_src_getrange_wait(
     GstPad *		pad,
@@ -540,9 +3935,13 @@ gst_add_tag_mux_src_getrange_wait(
     GstBuffer **	buffer)
 {
     GST_TRACE_OBJECT(pad, ">");
-    gst_add_tag_mux_wait(GST_ADD_TAG_MUX(parent));
-    GstFlowReturn ret = gst_add_tag_mux_src_getrange_identity(
-	pad, parent, offset, length, buffer);
+    GstAddTagMux * addtagmux = GST_ADD_TAG_MUX(parent);
+    GstAddTagMuxPair * pair = gst_pad_get_element_private(pad);
+    GstFlowReturn ret = gst_add_tag_mux_wait(addtagmux, pair);
+    if (GST_FLOW_OK == ret) {
+	ret = gst_add_tag_mux_src_getrange_identity(
+	    pad, parent, offset, length, buffer);
+    }
     GST_TRACE_OBJECT(pad, "< %d", ret);
     return ret;
 }
@@ -554,46 +3953,266 @@ gst_add_tag_mux_src_event_identity(
     GstEvent *		event)
 {
     GST_TRACE_OBJECT(pad, ">");
-    gboolean ret = gst_pad_push_event(GST_ADD_TAG_MUX(parent)->sink, event);
+    GstAddTagMuxPair * pair = gst_pad_get_element_private(pad);
+    gboolean ret = gst_pad_push_event(pair->sink, event);
     GST_TRACE_OBJECT(pad, "< %d", ret);
     return ret;
 }
 
+/// Wait on a main stream (again)
 static void
-gst_add_tag_mux_init(
-    GstAddTagMux *	addtagmux)
+gst_add_tag_mux_pair_wait_functions(
+    GstAddTagMuxPair *	pair)
 {
-    GST_TRACE_OBJECT(addtagmux, ">");
-    GstElement * element = GST_ELEMENT(addtagmux);
-    GstPad * pad;
-
-    // create "sink" pad from template and configure
-    addtagmux->sink = pad = gst_pad_new_from_static_template(
-	&gst_add_tag_mux_sink_template, "sink");
-    GST_OBJECT_FLAG_SET(pad, GST_PAD_FLAG_NEED_PARENT);
-    gst_pad_set_chain_function(pad,
+    gst_pad_set_chain_function(pair->sink,
 	GST_DEBUG_FUNCPTR(gst_add_tag_mux_sink_chain_wait));
-    gst_pad_set_event_function(pad,
+    gst_pad_set_event_function(pair->sink,
 	GST_DEBUG_FUNCPTR(gst_add_tag_mux_sink_event_wait));
-    gst_element_add_pad(element, pad);
-
-    // create "src" pad from template and configure
-    addtagmux->src = pad = gst_pad_new_from_static_template(
-	&gst_add_tag_mux_src_template, "src");
-    GST_OBJECT_FLAG_SET(pad, GST_PAD_FLAG_NEED_PARENT);
-    gst_pad_set_getrange_function(pad,
+    gst_pad_set_query_function(pair->sink,
+	GST_DEBUG_FUNCPTR(gst_add_tag_mux_sink_query_wait));
+    gst_pad_set_getrange_function(pair->src,
 	GST_DEBUG_FUNCPTR(gst_add_tag_mux_src_getrange_wait));
-    gst_pad_set_event_function(pad,
+}
+
+/// Make a main stream pair of (new) sink and src pads and add them
+static GstAddTagMuxPair *
+gst_add_tag_mux_pair_new(
+    GstAddTagMux *	addtagmux,
+    GstPad *		sink,
+    GstPad *		src)
+{
+    GST_TRACE_OBJECT(addtagmux, "> %" GST_PTR_FORMAT, sink);
+    GstAddTagMuxPair * pair = g_slice_new0(GstAddTagMuxPair);
+    pair->sink = sink;
+    pair->src = src;
+    g_queue_init(&pair->queue);
+    pair->queue_first = GST_CLOCK_TIME_NONE;
+    pair->queue_last = GST_CLOCK_TIME_NONE;
+    gst_add_tag_mux_flac_scan_init(&pair->flac_scan);
+
+    GST_OBJECT_FLAG_SET(sink, GST_PAD_FLAG_NEED_PARENT);
+    gst_pad_set_element_private(sink, pair);
+    GST_OBJECT_FLAG_SET(src, GST_PAD_FLAG_NEED_PARENT);
+    gst_pad_set_element_private(src, pair);
+    gst_pad_set_activatemode_function(src,
+	GST_DEBUG_FUNCPTR(gst_add_tag_mux_src_activate_mode));
+    gst_pad_set_event_function(src,
 	GST_DEBUG_FUNCPTR(gst_add_tag_mux_src_event_identity));
-    gst_element_add_pad(element, pad);
+    gst_add_tag_mux_pair_wait_functions(pair);
+
+    g_mutex_lock(&addtagmux->mutex);
+    addtagmux->pairs = g_list_append(addtagmux->pairs, pair);
+    g_mutex_unlock(&addtagmux->mutex);
+    gst_element_add_pad(GST_ELEMENT(addtagmux), sink);
+    gst_element_add_pad(GST_ELEMENT(addtagmux), src);
+    GST_TRACE_OBJECT(addtagmux, "<");
+    return pair;
+}
+
+/// Free a main stream pair whose pads are gone
+static void
+gst_add_tag_mux_pair_free(
+    GstAddTagMuxPair *	pair)
+{
+    g_queue_clear_full(&pair->queue, (GDestroyNotify) gst_mini_object_unref);
+    if (pair->taglist) {
+	gst_tag_list_unref(pair->taglist);
+    }
+    if (pair->tags) {
+	gst_event_unref(pair->tags);
+    }
+    g_slice_free(GstAddTagMuxPair, pair);
+}
+
+/// Prepare a main stream pair for streaming again.
+/// Call with mutex held.
+static void
+gst_add_tag_mux_pair_reset(
+    GstAddTagMuxPair *	pair)
+{
+    gst_add_tag_mux_queue_clear(pair, FALSE);
+    pair->flushing = FALSE;
+    pair->released = FALSE;
+    if (pair->taglist) {
+	gst_tag_list_unref(pair->taglist);
+	pair->taglist = NULL;
+    }
+    g_atomic_int_set(&pair->late, FALSE);
+    pair->scanning = FALSE;
+    if (pair->tags) {
+	gst_event_unref(pair->tags);
+	pair->tags = NULL;
+    }
+    g_atomic_int_set(&pair->holding, FALSE);
+    pair->probed = FALSE;
+    pair->keeps_images = FALSE;
+    gst_add_tag_mux_pair_wait_functions(pair);
+}
+
+/// Prepare for streaming again, as if we never had.
+/// Our pads are not active so none of their functions are running.
+static void
+gst_add_tag_mux_reset(
+    GstAddTagMux *	addtagmux)
+{
+    GST_TRACE_OBJECT(addtagmux, ">");
+
+    GList * link;
+    g_mutex_lock(&addtagmux->mutex);
+    for (link = addtagmux->pairs; link; link = link->next) {
+	gst_add_tag_mux_pair_reset(link->data);
+    }
+    if (addtagmux->taglist) {
+	gst_tag_list_unref(addtagmux->taglist);
+    }
+    addtagmux->taglist = gst_tag_list_new_empty();
+
+    addtagmux->released = FALSE;
+    addtagmux->finishing = FALSE;
+    addtagmux->wait_time = 0;
+    addtagmux->over_budget_images = 0;
+    addtagmux->passed = FALSE;
+
+    addtagmux->count = 0;
+    addtagmux->required = 0;
+    g_mutex_unlock(&addtagmux->mutex);
+
+    // wait for what is being resolved before taking the object lock,
+    // as a resolving thread may need it (to log against its pad)
+    GST_OBJECT_LOCK(addtagmux);
+    GList * pads = g_list_copy_deep(GST_ELEMENT(addtagmux)->sinkpads,
+	gst_add_tag_mux_copy_ref, NULL);
+    GST_OBJECT_UNLOCK(addtagmux);
+    for (link = pads; link; link = link->next) {
+	if (!GST_IS_ADD_TAG_MUX_PAD(link->data)) {
+	    continue;
+	}
+	g_mutex_lock(&addtagmux->mutex);
+	GPtrArray * resolved = gst_add_tag_mux_pad_take_resolved(
+	    GST_ADD_TAG_MUX_PAD(link->data), addtagmux);
+	g_mutex_unlock(&addtagmux->mutex);
+	if (resolved) {
+	    gst_add_tag_mux_resolved_free(resolved);
+	}
+    }
+    g_list_free_full(pads, gst_object_unref);
+
+    // every linked additional stream is pending again.
+    // our unlink function holds the pad lock when taking our mutex
+    // so we must not take them in the other order
+    GST_OBJECT_LOCK(addtagmux);
+    for (link = GST_ELEMENT(addtagmux)->sinkpads; link; link = link->next) {
+	if (!GST_IS_ADD_TAG_MUX_PAD(link->data)) {
+	    continue;
+	}
+	GstAddTagMuxPad * addtagmuxpad = GST_ADD_TAG_MUX_PAD(link->data);
+	gboolean linked = gst_pad_is_linked(GST_PAD(addtagmuxpad));
+	g_mutex_lock(&addtagmux->mutex);
+	addtagmuxpad->pending = linked;
+	addtagmuxpad->dropped = FALSE;
+	if (linked) {
+	    ++addtagmux->count;
+	    if (addtagmuxpad->required) {
+		++addtagmux->required;
+	    }
+	}
+	gst_pad_set_chain_function(GST_PAD(addtagmuxpad),
+	    GST_DEBUG_FUNCPTR(gst_add_tag_mux_pad_sink_chain));
+	g_free(addtagmuxpad->cache_key);
+	addtagmuxpad->cache_key = NULL;
+	if (addtagmuxpad->samples) {
+	    g_ptr_array_unref(addtagmuxpad->samples);
+	    addtagmuxpad->samples = NULL;
+	}
+	addtagmuxpad->image_type = GST_TAG_IMAGE_TYPE_FRONT_COVER;
+	if (addtagmuxpad->caps) {
+	    gst_caps_unref(addtagmuxpad->caps);
+	    addtagmuxpad->caps = NULL;
+	}
+	if (addtagmuxpad->taglist) {
+	    gst_tag_list_unref(addtagmuxpad->taglist);
+	    addtagmuxpad->taglist = NULL;
+	}
+	if (addtagmuxpad->accumulated) {
+	    gst_buffer_unref(addtagmuxpad->accumulated);
+	    addtagmuxpad->accumulated = NULL;
+	}
+	addtagmuxpad->accumulated_bytes = 0;
+	gst_add_tag_mux_pad_discharge(addtagmuxpad, addtagmux);
+	addtagmuxpad->bytes = 0;
+	addtagmuxpad->typefind_time = 0;
+	g_mutex_unlock(&addtagmux->mutex);
+    }
+    GST_OBJECT_UNLOCK(addtagmux);
+
+    // and what released pads left behind
+    g_mutex_lock(&addtagmux->mutex);
+    GList * kept = addtagmux->kept;
+    addtagmux->kept = NULL;
+    for (link = kept; link; link = link->next) {
+	gst_add_tag_mux_pad_discharge(link->data, addtagmux);
+    }
+    gst_add_tag_mux_discharge(addtagmux, addtagmux->held_bytes);
+    g_mutex_unlock(&addtagmux->mutex);
+    g_list_free_full(kept, gst_object_unref);
+
+    GST_TRACE_OBJECT(addtagmux, "<");
+}
+
+static void
+gst_add_tag_mux_init(
+    GstAddTagMux *	addtagmux)
+{
+    GST_TRACE_OBJECT(addtagmux, ">");
 
     g_mutex_init(&addtagmux->mutex);
     addtagmux->index = 0;
+    addtagmux->kept = NULL;
     addtagmux->count = 0;
+    addtagmux->required = 0;
     g_cond_init(&addtagmux->cond);
 
+    // our "sink" and "src" pads, from templates, for the first main stream
+    addtagmux->pairs = NULL;
+    addtagmux->pair_index = 0;
+    GstPad * sink = gst_pad_new_from_static_template(
+	&gst_add_tag_mux_sink_template, "sink");
+    GstPad * src = gst_pad_new_from_static_template(
+	&gst_add_tag_mux_src_template, "src");
+    gst_add_tag_mux_pair_new(addtagmux, sink, src);
+
     addtagmux->taglist = gst_tag_list_new_empty();
 
+    addtagmux->max_size_buffers = DEFAULT_MAX_SIZE_BUFFERS;
+    addtagmux->max_size_bytes = DEFAULT_MAX_SIZE_BYTES;
+    addtagmux->max_size_time = DEFAULT_MAX_SIZE_TIME;
+    addtagmux->location = NULL;
+    addtagmux->cover_directory = NULL;
+    addtagmux->cover_patterns = g_strdup(DEFAULT_COVER_PATTERNS);
+    addtagmux->trust_caps = TRUE;
+    addtagmux->timeout = 0;
+    addtagmux->deadline = 0;
+    addtagmux->late_tags = FALSE;
+    addtagmux->dedupe = FALSE;
+    addtagmux->max_width = 0;
+    addtagmux->max_height = 0;
+    addtagmux->select = GST_ADD_TAG_MUX_SELECT_ALL;
+    addtagmux->released = FALSE;
+    addtagmux->finishing = FALSE;
+    addtagmux->wait_time = 0;
+    addtagmux->stats = NULL;
+    addtagmux->max_bytes = 0;
+    addtagmux->held_bytes = 0;
+    addtagmux->over_budget = GST_ADD_TAG_MUX_OVER_BUDGET_DROP;
+    addtagmux->over_budget_images = 0;
+    addtagmux->passthrough = GST_TAG_IMAGE_TYPE_NONE;
+    addtagmux->passed = FALSE;
+    addtagmux->merge_mode = GST_TAG_MERGE_UNDEFINED;
+    addtagmux->picture_comments = FALSE;
+    addtagmux->resolve_uris = FALSE;
+    addtagmux->probe_downstream = FALSE;
+    addtagmux->bus = NULL;
+
     GST_TRACE_OBJECT(addtagmux, "<");
 }
 
@@ -22,6 +22,9 @@
 
 #include <gst/gst.h>
 #include <gst/gstpad.h>
+#include <gst/tag/tag.h>
+
+#include "gstaddtagmuxprobe.h"
 
 G_BEGIN_DECLS
 
@@ -36,6 +39,28 @@ typedef struct _GstAddTagMuxPadClass	GstAddTagMuxPadClass;
 
 struct _GstAddTagMuxPad {
     GstPad		pad;
+    gboolean		pending;	// counted as pending, while linked
+    gboolean		dropped;	// settled without its tags
+    gchar *		cache_key;	// identifies samples for cache
+    GPtrArray *		samples;	// of GstSample, made for cache
+    GstElement *	source;		// upstream source locked on cache hit
+    GstTagImageType	image_type;	// from caps
+    GstCaps *		caps;		// trusted from caps, else typefind
+    GstTagList *	taglist;	// ours alone until merged on release
+    gboolean		required;	// main stream waits for it
+    gint		priority;	// higher merged first
+    gint		index;		// requested order, merged first
+    gboolean		accumulate;	// buffers into one image, until EOS
+    guint		accumulate_max_bytes;	// 0 is unlimited
+    GstBuffer *		accumulated;	// appended buffers
+    gsize		accumulated_bytes;
+    guint		max_bytes;	// of images held, 0 is unlimited
+    gsize		held_bytes;	// of images held until release
+    guint64		bytes;		// streamed, for stats
+    GstClockTime	typefind_time;	// spent typefinding, for stats
+    GPtrArray *		resolved;	// samples from uri-list, or NULL
+    guint		resolving;	// uris not yet resolved
+    GCond		resolve_cond;	// signaled when none are resolving
 };
 
 struct _GstAddTagMuxPadClass {
@@ -50,18 +75,92 @@ GType gst_add_tag_mux_get_type(void);
 #define GST_IS_ADD_TAG_MUX(o)		(G_TYPE_CHECK_INSTANCE_TYPE((o),	GST_TYPE_ADD_TAG_MUX))
 #define GST_IS_ADD_TAG_MUX_CLASS(c)	(G_TYPE_CHECK_CLASS_TYPE((c),		GST_TYPE_ADD_TAG_MUX))
 
+/// How to select among images of the same image-type
+typedef enum {
+    GST_ADD_TAG_MUX_SELECT_ALL,		// keep them all
+    GST_ADD_TAG_MUX_SELECT_FIRST_FIT,	// first that fits, else first
+    GST_ADD_TAG_MUX_SELECT_LARGEST_FIT,	// largest that fits, else smallest
+} GstAddTagMuxSelect;
+
+#define GST_TYPE_ADD_TAG_MUX_SELECT	(gst_add_tag_mux_select_get_type())
+GType gst_add_tag_mux_select_get_type(void);
+
+/// What to do with an image that would exceed a max-bytes limit
+typedef enum {
+    GST_ADD_TAG_MUX_OVER_BUDGET_DROP,	// drop it
+    GST_ADD_TAG_MUX_OVER_BUDGET_SCALE,	// scale JPEG down, else drop it
+    GST_ADD_TAG_MUX_OVER_BUDGET_ERROR,	// post an error
+} GstAddTagMuxOverBudget;
+
+#define GST_TYPE_ADD_TAG_MUX_OVER_BUDGET	(gst_add_tag_mux_over_budget_get_type())
+GType gst_add_tag_mux_over_budget_get_type(void);
+
+/// A main stream, from its sink pad to its src pad.
+/// The first is that of our "sink" and "src" pads, others are requested.
+/// Each is held until, and released with, the same tags.
+typedef struct {
+    GstPad *		sink;
+    GstPad *		src;
+    GQueue		queue;		// main stream held while count
+    guint		queue_buffers;	// buffers in queue
+    guint64		queue_bytes;	// bytes of buffers in queue
+    GstClockTime	queue_first;	// first buffer timestamp in queue
+    GstClockTime	queue_last;	// last buffer timestamp in queue
+    gboolean		flushing;	// main stream is flushing
+    gboolean		released;	// took our tags
+    GstTagList *	taglist;	// as pushed (maybe merged), or NULL
+    gint volatile	late;		// late tags to push
+    gboolean		scanning;	// main stream for passthrough
+    GstAddTagMuxFlacScan	flac_scan;	// of main stream
+    GstEvent *		tags;		// ours, until pushed with main stream
+    gint volatile	holding;	// tags
+    gboolean		probed;		// downstream, for a tag writer
+    gboolean		keeps_images;	// downstream, as probed
+} GstAddTagMuxPair;
+
 typedef struct _GstAddTagMux		GstAddTagMux;
 typedef struct _GstAddTagMuxClass	GstAddTagMuxClass;
 
 struct _GstAddTagMux {
     GstElement		element;	// we are a GstElement
-    GstPad *		sink;		// our main sink
-    GstPad *		src;		// our only src
+    GList *		pairs;		// of GstAddTagMuxPair, first always
+    gint		pair_index;	// next index for main pair
     GMutex		mutex;		// lock on index and count changes
     gint		index;		// next index for image pad
+    GList *		kept;		// released image pads, with their tags
     gint volatile	count;		// images pending
+    gint		required;	// required images pending
     GCond		cond;		// block on 0 == count condition
-    GstTagList *	taglist;	//
+    GstTagList *	taglist;	// location images, then merged pads
+    guint		max_size_buffers;	// queue limits, 0 is unlimited
+    guint		max_size_bytes;
+    guint64		max_size_time;
+    gchar *		location;	// [image-type=]path[:...] images
+    gboolean		trust_caps;	// rather than typefind
+    GstClockTime	timeout;	// to wait for images, 0 is forever
+    gint64		deadline;	// monotonic time from timeout, or 0
+    gboolean		late_tags;	// push tags of late images
+    gboolean		dedupe;		// drop images with the same content
+    guint		max_width;	// to scale JPEG images to, 0 is any
+    guint		max_height;
+    GstAddTagMuxSelect	select;		// among images of an image-type
+    gboolean		released;	// main streams no longer wait
+    gboolean		finishing;	// taglist, without the mutex
+    GstClockTime	wait_time;	// main stream blocked, for stats
+    GstStructure *	stats;		// of the last release, or NULL
+    guint64		max_bytes;	// of images held, 0 is unlimited
+    guint64		held_bytes;	// of images held until release
+    GstAddTagMuxOverBudget	over_budget;	// policy
+    guint		over_budget_images;	// for stats
+    GstTagImageType	passthrough;	// if the main stream has one
+    gboolean		passed;		// through, for stats
+    GstTagMergeMode	merge_mode;	// into main stream tags, or UNDEFINED
+    gboolean		picture_comments;	// rather than image tags
+    gboolean		resolve_uris;	// of text/uri-list into images
+    gchar *		cover_directory;	// to find images in
+    gchar *		cover_patterns;	// [image-type=]glob[:...] to find
+    gboolean		probe_downstream;	// for a tag writer keeping images
+    GstBus *		bus;		// watched for errors upstream, or NULL
 };
 
 struct _GstAddTagMuxClass {
@@ -0,0 +1,381 @@
+/* GStreamer
+ * Copyright (C) 2015 Ross Tyler
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+/// addtagmux-batch converts each FLAC song in a source folder (tree)
+/// to MP3 or Ogg/Vorbis in a parallel target folder (tree),
+/// adding the cover image of its folder as a front-cover tag.
+/// All songs are converted by one process, on a pool of threads,
+/// so the plugin registry is loaded once and each cover is made once:
+/// the first song of a folder is converted before the others
+/// so that they find its cover in the addtagmux cache.
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+#include <gst/gst.h>
+#include <glib/gstdio.h>
+
+GST_DEBUG_CATEGORY_STATIC(gst_add_tag_mux_batch_debug_category);
+#define GST_CAT_DEFAULT gst_add_tag_mux_batch_debug_category
+
+/// Names of a cover image in a folder, in order of preference
+static gchar const * const covers[] = {
+    "cover.jpg",
+    "folder.jpg",
+    "front.jpg",
+    "cover.png",
+    "folder.png",
+    "front.png",
+    NULL,
+};
+
+/// What follows the decoded audio, by target format
+static struct {
+    gchar const *	name;
+    gchar const *	extension;
+    gchar const *	description;
+} const formats[] = {
+    {"mp3", ".mp3", "lamemp3enc ! id3v2mux"},
+    {"ogg", ".ogg", "vorbisenc ! oggmux"},
+};
+
+/// Options
+static gchar *		format = "mp3";
+static gint		jobs = 0;
+static gint		max_size = 300;
+static guint64		cache_max_bytes = 64 * 1024 * 1024;
+
+/// A folder of songs to convert
+typedef struct {
+    gchar *		source;		// folder
+    gchar *		target;		// folder
+    gchar *		cover;		// path, or NULL
+    GPtrArray *		songs;		// of names, without extension
+} Folder;
+
+/// A song to convert, the first of its folder or not
+typedef struct {
+    Folder *		folder;
+    guint		index;		// into folder songs
+} Job;
+
+static struct {
+    GThreadPool *	pool;
+    gchar const *	extension;
+    gchar const *	description;
+    GMutex		mutex;		// lock on pending and failed
+    GCond		cond;		// signaled when nothing is pending
+    guint		pending;	// jobs not yet done
+    guint		failed;		// jobs that failed
+} batch;
+
+static void
+folder_free(
+    gpointer		data)
+{
+    Folder * folder = data;
+    g_free(folder->source);
+    g_free(folder->target);
+    g_free(folder->cover);
+    g_ptr_array_unref(folder->songs);
+    g_slice_free(Folder, folder);
+}
+
+/// Push a job for a song
+static void
+batch_push(
+    Folder *		folder,
+    guint		index)
+{
+    Job * job = g_slice_new(Job);
+    job->folder = folder;
+    job->index = index;
+    g_mutex_lock(&batch.mutex);
+    ++batch.pending;
+    g_mutex_unlock(&batch.mutex);
+    g_thread_pool_push(batch.pool, job, NULL);
+}
+
+/// Run a pipeline to its end.
+/// Return FALSE on error.
+static gboolean
+run(
+    GstElement *	pipeline,
+    gchar const *	song)
+{
+    gboolean ret = FALSE;
+    if (GST_STATE_CHANGE_FAILURE
+	    == gst_element_set_state(pipeline, GST_STATE_PLAYING)) {
+	g_printerr("%s: could not start\n", song);
+    } else {
+	GstBus * bus = gst_element_get_bus(pipeline);
+	GstMessage * message = gst_bus_timed_pop_filtered(bus,
+	    GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+	if (GST_MESSAGE_ERROR == GST_MESSAGE_TYPE(message)) {
+	    GError * error;
+	    gchar * debug;
+	    gst_message_parse_error(message, &error, &debug);
+	    g_printerr("%s: %s\n", song, error->message);
+	    GST_DEBUG("%s: %s", song, debug);
+	    g_error_free(error);
+	    g_free(debug);
+	} else {
+	    ret = TRUE;
+	}
+	gst_message_unref(message);
+	gst_object_unref(bus);
+    }
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    return ret;
+}
+
+/// Set a property of an element, by name, in a pipeline
+static void
+set(
+    GstElement *	pipeline,
+    gchar const *	name,
+    gchar const *	property,
+    gchar const *	value)
+{
+    GstElement * element = gst_bin_get_by_name(GST_BIN(pipeline), name);
+    g_object_set(element, property, value, NULL);
+    gst_object_unref(element);
+}
+
+/// Convert a song.
+/// Locations are set on named elements of the pipeline
+/// so that they need not be quoted in its description.
+static gboolean
+convert(
+    Folder *		folder,
+    gchar const *	song)
+{
+    gchar * description = g_strdup_printf(
+	"filesrc name=source"
+	" ! addtagmux name=addtagmux cache-max-bytes=%" G_GUINT64_FORMAT
+	    " max-width=%d max-height=%d"
+	    "%s"
+	" addtagmux. ! flacparse ! flacdec ! audioconvert ! %s"
+	" ! filesink name=target",
+	cache_max_bytes, max_size, max_size,
+	folder->cover
+	    ? " sink_0::accumulate=true filesrc name=cover ! addtagmux.sink_0"
+	    : "",
+	batch.description);
+    GError * error = NULL;
+    GstElement * pipeline = gst_parse_launch(description, &error);
+    g_free(description);
+    if (!pipeline) {
+	g_printerr("%s: %s\n", song, error->message);
+	g_error_free(error);
+	return FALSE;
+    }
+    if (error) {
+	g_printerr("%s: %s\n", song, error->message);
+	g_error_free(error);
+    }
+
+    gchar * source = g_strconcat(folder->source, G_DIR_SEPARATOR_S,
+	song, ".flac", NULL);
+    gchar * target = g_strconcat(folder->target, G_DIR_SEPARATOR_S,
+	song, batch.extension, NULL);
+    set(pipeline, "source", "location", source);
+    set(pipeline, "target", "location", target);
+    if (folder->cover) {
+	set(pipeline, "cover", "location", folder->cover);
+    }
+    gboolean ret = run(pipeline, source);
+    if (ret) {
+	g_print("%s\n", target);
+    } else {
+	g_unlink(target);
+    }
+    g_free(target);
+    g_free(source);
+    gst_object_unref(pipeline);
+    return ret;
+}
+
+/// Do a job from our pool.
+/// Once the first song of a folder is done (its cover is cached)
+/// push the rest.
+static void
+batch_job(
+    gpointer		data,
+    gpointer		user_data)
+{
+    Job * job = data;
+    Folder * folder = job->folder;
+    gboolean ok = convert(folder,
+	g_ptr_array_index(folder->songs, job->index));
+    if (!job->index) {
+	guint i;
+	for (i = 1; i < folder->songs->len; ++i) {
+	    batch_push(folder, i);
+	}
+    }
+    g_slice_free(Job, job);
+    g_mutex_lock(&batch.mutex);
+    if (!ok) {
+	++batch.failed;
+    }
+    if (!--batch.pending) {
+	g_cond_signal(&batch.cond);
+    }
+    g_mutex_unlock(&batch.mutex);
+}
+
+/// Gather the folders, under and including source, that have songs
+static void
+gather(
+    GPtrArray *		folders,
+    gchar const *	source,
+    gchar const *	target)
+{
+    GError * error = NULL;
+    GDir * dir = g_dir_open(source, 0, &error);
+    if (!dir) {
+	g_printerr("%s\n", error->message);
+	g_error_free(error);
+	return;
+    }
+    Folder * folder = g_slice_new0(Folder);
+    folder->source = g_strdup(source);
+    folder->target = g_strdup(target);
+    folder->songs = g_ptr_array_new_with_free_func(g_free);
+    gchar const * name;
+    while ((name = g_dir_read_name(dir))) {
+	gchar * path = g_build_filename(source, name, NULL);
+	if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+	    gchar * t = g_build_filename(target, name, NULL);
+	    gather(folders, path, t);
+	    g_free(t);
+	} else if (g_str_has_suffix(name, ".flac")) {
+	    g_ptr_array_add(folder->songs,
+		g_strndup(name, strlen(name) - strlen(".flac")));
+	}
+	g_free(path);
+    }
+    g_dir_close(dir);
+
+    gchar const * const * cover;
+    for (cover = covers; *cover && !folder->cover; ++cover) {
+	gchar * path = g_build_filename(source, *cover, NULL);
+	if (g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
+	    folder->cover = path;
+	} else {
+	    g_free(path);
+	}
+    }
+
+    if (folder->songs->len) {
+	g_ptr_array_add(folders, folder);
+    } else {
+	folder_free(folder);
+    }
+}
+
+int
+main(
+    int			argc,
+    char **		argv)
+{
+    GOptionEntry const entries[] = {
+	{"format", 'f', 0, G_OPTION_ARG_STRING, &format,
+	    "Target format, mp3 (default) or ogg", "FORMAT"},
+	{"jobs", 'j', 0, G_OPTION_ARG_INT, &jobs,
+	    "Songs to convert at a time (default, one per processor)", "N"},
+	{"max-size", 's', 0, G_OPTION_ARG_INT, &max_size,
+	    "Scale covers down to fit N x N (default 300, 0 is any)", "N"},
+	{NULL},
+    };
+    GOptionContext * context = g_option_context_new("SOURCE TARGET");
+    g_option_context_set_summary(context,
+	"Convert each FLAC song under SOURCE to one under TARGET"
+	" with the cover of its folder.");
+    g_option_context_add_main_entries(context, entries, NULL);
+    g_option_context_add_group(context, gst_init_get_option_group());
+    GError * error = NULL;
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+	g_printerr("%s\n", error->message);
+	return 2;
+    }
+    if (3 != argc) {
+	gchar * help = g_option_context_get_help(context, TRUE, NULL);
+	g_printerr("%s", help);
+	g_free(help);
+	return 2;
+    }
+    g_option_context_free(context);
+    GST_DEBUG_CATEGORY_INIT(gst_add_tag_mux_batch_debug_category,
+	"addtagmuxbatch", 0, "debug category for addtagmux-batch");
+
+    guint i;
+    for (i = 0; i < G_N_ELEMENTS(formats); ++i) {
+	if (g_str_equal(format, formats[i].name)) {
+	    batch.extension = formats[i].extension;
+	    batch.description = formats[i].description;
+	}
+    }
+    if (!batch.description) {
+	g_printerr("unknown format %s\n", format);
+	return 2;
+    }
+    GstElementFactory * factory = gst_element_factory_find("addtagmux");
+    if (!factory) {
+	g_printerr("addtagmux not found (see GST_PLUGIN_PATH)\n");
+	return 1;
+    }
+    gst_object_unref(factory);
+
+    GPtrArray * folders = g_ptr_array_new_with_free_func(folder_free);
+    gather(folders, argv[1], argv[2]);
+
+    g_mutex_init(&batch.mutex);
+    g_cond_init(&batch.cond);
+    batch.pool = g_thread_pool_new(batch_job, NULL,
+	0 < jobs ? jobs : (gint) g_get_num_processors(), FALSE, NULL);
+
+    // the first song of each folder first, then the rest of the folder
+    for (i = 0; i < folders->len; ++i) {
+	Folder * folder = g_ptr_array_index(folders, i);
+	if (g_mkdir_with_parents(folder->target, 0777)) {
+	    g_printerr("%s: %s\n", folder->target, g_strerror(errno));
+	    continue;
+	}
+	batch_push(folder, 0);
+    }
+    g_mutex_lock(&batch.mutex);
+    while (batch.pending) {
+	g_cond_wait(&batch.cond, &batch.mutex);
+    }
+    guint failed = batch.failed;
+    g_mutex_unlock(&batch.mutex);
+
+    g_thread_pool_free(batch.pool, FALSE, TRUE);
+    g_cond_clear(&batch.cond);
+    g_mutex_clear(&batch.mutex);
+    g_ptr_array_unref(folders);
+    gst_deinit();
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,176 @@
+/* GStreamer
+ * Copyright (C) 2015 Ross Tyler
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+
+#include "gstaddtagmuxcache.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_add_tag_mux_cache_debug_category);
+#define GST_CAT_DEFAULT gst_add_tag_mux_cache_debug_category
+
+typedef struct {
+    GList		link;		// in lru, data is this entry
+    gchar *		key;		// owned by table
+    GPtrArray *		samples;	// of GstSample
+    gsize		size;		// bytes of sample buffers
+} Entry;
+
+static struct {
+    GMutex		mutex;		// lock on everything below
+    GHashTable *	table;		// key to Entry
+    GQueue		lru;		// most recently used at head
+    guint64		bytes;		// sum of Entry size
+    guint64		max_bytes;	// limit on bytes, 0 disables
+} cache;
+
+static void
+entry_free(
+    gpointer		data)
+{
+    Entry * entry = data;
+    g_ptr_array_unref(entry->samples);
+    g_slice_free(Entry, entry);
+}
+
+/// Initialize the cache (and our debug category) once, on first use,
+/// before anything is logged
+static void
+cache_init(void)
+{
+    static gsize init = 0;
+    if (g_once_init_enter(&init)) {
+	GST_DEBUG_CATEGORY_INIT(gst_add_tag_mux_cache_debug_category,
+	    "addtagmuxcache", 0, "debug category for addtagmux cache");
+	g_mutex_init(&cache.mutex);
+	cache.table = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, entry_free);
+	g_queue_init(&cache.lru);
+	cache.bytes = 0;
+	cache.max_bytes = 0;
+	g_once_init_leave(&init, 1);
+    }
+}
+
+/// Initialize the cache, if need be, and return it locked
+static void
+cache_lock(void)
+{
+    cache_init();
+    g_mutex_lock(&cache.mutex);
+}
+
+/// Evict least recently used entries until we are within our limit.
+/// Called with the cache locked
+static void
+cache_evict(void)
+{
+    while (cache.bytes > cache.max_bytes) {
+	GList * link = g_queue_peek_tail_link(&cache.lru);
+	Entry * entry = link->data;
+	GST_DEBUG("evict %s", entry->key);
+	g_queue_unlink(&cache.lru, link);
+	cache.bytes -= entry->size;
+	g_hash_table_remove(cache.table, entry->key);
+    }
+}
+
+void
+gst_add_tag_mux_cache_set_max_bytes(
+    guint64		max_bytes)
+{
+    cache_init();
+    GST_TRACE("> %" G_GUINT64_FORMAT, max_bytes);
+    cache_lock();
+    cache.max_bytes = max_bytes;
+    cache_evict();
+    g_mutex_unlock(&cache.mutex);
+    GST_TRACE("<");
+}
+
+guint64
+gst_add_tag_mux_cache_get_max_bytes(void)
+{
+    cache_lock();
+    guint64 ret = cache.max_bytes;
+    g_mutex_unlock(&cache.mutex);
+    return ret;
+}
+
+GPtrArray *
+gst_add_tag_mux_cache_lookup(
+    gchar const *	key)
+{
+    cache_init();
+    GST_TRACE("> %s", key);
+    GPtrArray * ret = NULL;
+    cache_lock();
+    Entry * entry = g_hash_table_lookup(cache.table, key);
+    if (entry) {
+	// most recently used
+	g_queue_unlink(&cache.lru, &entry->link);
+	g_queue_push_head_link(&cache.lru, &entry->link);
+	ret = g_ptr_array_ref(entry->samples);
+    }
+    g_mutex_unlock(&cache.mutex);
+    GST_TRACE("< %p", ret);
+    return ret;
+}
+
+void
+gst_add_tag_mux_cache_insert(
+    gchar const *	key,
+    GPtrArray *		samples)
+{
+    cache_init();
+    GST_TRACE("> %s", key);
+    gsize size = 0;
+    guint i;
+    for (i = 0; i < samples->len; ++i) {
+	GstBuffer * buffer = gst_sample_get_buffer(g_ptr_array_index(samples, i));
+	if (buffer) {
+	    size += gst_buffer_get_size(buffer);
+	}
+    }
+    cache_lock();
+    if (size <= cache.max_bytes) {
+	Entry * entry = g_hash_table_lookup(cache.table, key);
+	if (entry) {
+	    g_queue_unlink(&cache.lru, &entry->link);
+	    cache.bytes -= entry->size;
+	    g_hash_table_remove(cache.table, key);
+	}
+	entry = g_slice_new0(Entry);
+	entry->link.data = entry;
+	entry->key = g_strdup(key);
+	entry->samples = g_ptr_array_ref(samples);
+	entry->size = size;
+	g_hash_table_insert(cache.table, entry->key, entry);
+	g_queue_push_head_link(&cache.lru, &entry->link);
+	cache.bytes += size;
+	cache_evict();
+	GST_DEBUG("insert %s %" G_GSIZE_FORMAT " bytes, %" G_GUINT64_FORMAT
+	    " total", key, size, cache.bytes);
+    }
+    g_mutex_unlock(&cache.mutex);
+    GST_TRACE("<");
+}
@@ -0,0 +1,47 @@
+/* GStreamer
+ * Copyright (C) 2015 Ross Tyler
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifndef _GST_ADD_TAG_MUX_CACHE_H_
+#define _GST_ADD_TAG_MUX_CACHE_H_
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/// A process-wide cache of the GstSamples made from an additional stream,
+/// shared by all addtagmux elements.
+/// Samples are kept in a GPtrArray (that owns a reference to each)
+/// and looked up by a key that identifies what made them.
+/// The least recently used are evicted to keep within a size limit (bytes).
+/// A limit of 0 disables the cache.
+
+void		gst_add_tag_mux_cache_set_max_bytes(guint64 max_bytes);
+guint64		gst_add_tag_mux_cache_get_max_bytes(void);
+
+/// Returns a new reference to the cached samples for key, or NULL
+GPtrArray *	gst_add_tag_mux_cache_lookup(gchar const * key);
+
+/// Cache (a new reference to) samples for key
+void		gst_add_tag_mux_cache_insert(
+		    gchar const *	key,
+		    GPtrArray *		samples);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,606 @@
+/* GStreamer
+ * Copyright (C) 2015 Ross Tyler
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gst/gst.h>
+#include <glib/gstdio.h>
+
+#include "gstaddtagmuxdisk.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_add_tag_mux_disk_debug_category);
+#define GST_CAT_DEFAULT gst_add_tag_mux_disk_debug_category
+
+#define INDEX_NAME	"index"
+#define INDEX_MAGIC	0x41544d49	// ATMI
+#define ENTRY_MAGIC	0x41544d45	// ATME
+#define VERSION		2
+#define SLOTS		4096		// in the index
+#define PROBES		8		// slots that an entry may be in
+
+/// At the start of the index file, followed by its slots
+typedef struct {
+    guint32		magic;
+    guint32		version;
+    guint32		slots;
+    guint32		reserved;
+    guint64		bytes;		// sum of slot bytes
+    guint64		clock;		// ticks with each use
+} Index;
+
+/// What the index knows of an entry
+typedef struct {
+    guint64		hash;		// of key, 0 if free
+    guint64		used;		// clock when last used
+    guint64		bytes;		// of entry file
+    guint64		written;	// clock when entry file was written
+} Slot;
+
+#define INDEX_BYTES	(sizeof (Index) + SLOTS * sizeof (Slot))
+
+/// At the start of an entry file, followed by
+/// NUL terminated key, caps and info strings then (aligned) data
+typedef struct {
+    guint32		magic;
+    guint32		version;
+    guint32		key_length;	// each with NUL
+    guint32		caps_length;
+    guint32		info_length;	// 0 for none
+    guint32		reserved;
+    guint64		offset;		// of data
+    guint64		size;		// of data
+} Entry;
+
+static struct {
+    GMutex		mutex;		// lock on everything below
+    gchar *		directory;	// NULL disables
+    gint		fd;		// of index, flock'ed to change it
+    Index *		index;		// mapped, shared with other processes
+    Slot *		slots;		// after index
+    guint64		max_bytes;	// limit on index bytes
+} disk;
+
+/// Initialize the disk cache (and our debug category) once, on first use,
+/// before anything is logged
+static void
+disk_init(void)
+{
+    static gsize init = 0;
+    if (g_once_init_enter(&init)) {
+	GST_DEBUG_CATEGORY_INIT(gst_add_tag_mux_disk_debug_category,
+	    "addtagmuxdisk", 0, "debug category for addtagmux disk cache");
+	g_mutex_init(&disk.mutex);
+	disk.directory = NULL;
+	disk.fd = -1;
+	disk.index = NULL;
+	disk.slots = NULL;
+	disk.max_bytes = GST_ADD_TAG_MUX_DISK_DEFAULT_MAX_BYTES;
+	g_once_init_leave(&init, 1);
+    }
+}
+
+/// Initialize the disk cache, if need be, and return it locked
+static void
+disk_lock(void)
+{
+    disk_init();
+    g_mutex_lock(&disk.mutex);
+}
+
+/// FNV-1a of key, never 0 (which is a free slot)
+static guint64
+key_hash(
+    gchar const *	key)
+{
+    guint64 hash = G_GUINT64_CONSTANT(0xcbf29ce484222325);
+    for (; *key; ++key) {
+	hash = (hash ^ (guint8) *key) * G_GUINT64_CONSTANT(0x100000001b3);
+    }
+    return hash ? hash : 1;
+}
+
+/// The path of the entry file for hash
+static gchar *
+entry_path(
+    gchar const *	directory,
+    guint64		hash)
+{
+    gchar name[17];
+    g_snprintf(name, sizeof name, "%016" G_GINT64_MODIFIER "x", hash);
+    return g_build_filename(directory, name, NULL);
+}
+
+/// Remove the entry files (named by 16 hex digits) in directory
+static void
+directory_clear(
+    gchar const *	directory)
+{
+    GDir * dir = g_dir_open(directory, 0, NULL);
+    if (!dir) {
+	return;
+    }
+    gchar const * name;
+    while ((name = g_dir_read_name(dir))) {
+	if (16 == strlen(name) && 16 == strspn(name, "0123456789abcdef")) {
+	    gchar * path = g_build_filename(directory, name, NULL);
+	    g_unlink(path);
+	    g_free(path);
+	}
+    }
+    g_dir_close(dir);
+}
+
+/// Close the index, if open.
+/// Called with the mutex held.
+static void
+index_close(void)
+{
+    if (disk.index) {
+	munmap(disk.index, INDEX_BYTES);
+	disk.index = NULL;
+	disk.slots = NULL;
+    }
+    if (0 <= disk.fd) {
+	close(disk.fd);
+	disk.fd = -1;
+    }
+    g_free(disk.directory);
+    disk.directory = NULL;
+}
+
+/// Create a new (zeroed) index, locked, in directory
+/// and rename it over the one at path.
+/// Return its file descriptor, or -1.
+static gint
+index_create(
+    gchar const *	directory,
+    gchar const *	path)
+{
+    gchar * temporary = g_build_filename(directory, INDEX_NAME ".XXXXXX",
+	NULL);
+    gint fd = g_mkstemp_full(temporary, O_RDWR, 0666);
+    if (0 <= fd) {
+	flock(fd, LOCK_EX);
+	if (ftruncate(fd, INDEX_BYTES) || g_rename(temporary, path)) {
+	    GST_WARNING("%s: %s", temporary, g_strerror(errno));
+	    g_unlink(temporary);
+	    close(fd);
+	    fd = -1;
+	}
+    } else {
+	GST_WARNING("%s: %s", temporary, g_strerror(errno));
+    }
+    g_free(temporary);
+    return fd;
+}
+
+/// Open (or create) the index in directory and map it.
+/// An index that is not ours (or not of this version) is started over,
+/// without the entries it had.
+/// One of another size may be mapped by other processes, which would fault
+/// if we changed its size, so a new one is renamed over it.
+/// Called with the mutex held.
+static void
+index_open(
+    gchar const *	directory)
+{
+    if (g_mkdir_with_parents(directory, 0777)) {
+	GST_WARNING("%s: %s", directory, g_strerror(errno));
+	return;
+    }
+    gchar * path = g_build_filename(directory, INDEX_NAME, NULL);
+    gint fd;
+    struct stat st;
+    gboolean ok;
+    for (;;) {
+	fd = g_open(path, O_RDWR | O_CREAT, 0666);
+	if (0 > fd) {
+	    GST_WARNING("%s: %s", path, g_strerror(errno));
+	    g_free(path);
+	    return;
+	}
+	flock(fd, LOCK_EX);
+	// unless another process renamed a new one over it
+	// while we waited for the lock
+	struct stat named;
+	ok = !fstat(fd, &st) && !stat(path, &named);
+	if (!ok || (st.st_dev == named.st_dev && st.st_ino == named.st_ino)) {
+	    break;
+	}
+	flock(fd, LOCK_UN);
+	close(fd);
+    }
+    gboolean start = ok && INDEX_BYTES != (gsize) st.st_size;
+    if (start) {
+	gint created = index_create(directory, path);
+	flock(fd, LOCK_UN);
+	close(fd);
+	fd = created;
+	ok = 0 <= fd;
+    }
+    Index * index = ok
+	? mmap(NULL, INDEX_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+	: MAP_FAILED;
+    if (MAP_FAILED == index) {
+	GST_WARNING("%s: %s", path, g_strerror(errno));
+	if (0 <= fd) {
+	    flock(fd, LOCK_UN);
+	    close(fd);
+	}
+	g_free(path);
+	return;
+    }
+    if (start || INDEX_MAGIC != index->magic || VERSION != index->version
+	    || SLOTS != index->slots) {
+	GST_INFO("%s: start over", path);
+	directory_clear(directory);
+	memset(index, 0, INDEX_BYTES);
+	index->magic = INDEX_MAGIC;
+	index->version = VERSION;
+	index->slots = SLOTS;
+    }
+    flock(fd, LOCK_UN);
+    GST_DEBUG("%s: %" G_GUINT64_FORMAT " bytes", path, index->bytes);
+    g_free(path);
+    disk.directory = g_strdup(directory);
+    disk.fd = fd;
+    disk.index = index;
+    disk.slots = (Slot *) (index + 1);
+}
+
+/// The slot of hash, or NULL.
+/// Called with the index locked.
+static Slot *
+slot_find(
+    guint64		hash)
+{
+    guint i;
+    for (i = 0; i < PROBES; ++i) {
+	Slot * slot = disk.slots + (hash + i) % SLOTS;
+	if (hash == slot->hash) {
+	    return slot;
+	}
+    }
+    return NULL;
+}
+
+/// Forget an entry and remove its file.
+/// Called with the index locked.
+static void
+slot_evict(
+    Slot *		slot)
+{
+    gchar * path = entry_path(disk.directory, slot->hash);
+    GST_DEBUG("evict %s", path);
+    g_unlink(path);
+    g_free(path);
+    disk.index->bytes -= MIN(slot->bytes, disk.index->bytes);
+    memset(slot, 0, sizeof *slot);
+}
+
+/// Evict least recently used entries (but keep) until we are within our limit.
+/// Called with the index locked.
+static void
+index_evict(
+    Slot *		keep)
+{
+    while (disk.index->bytes > disk.max_bytes) {
+	Slot * lru = NULL;
+	guint i;
+	for (i = 0; i < SLOTS; ++i) {
+	    Slot * slot = disk.slots + i;
+	    if (slot->hash && slot != keep && (!lru || slot->used < lru->used)) {
+		lru = slot;
+	    }
+	}
+	if (!lru) {
+	    break;
+	}
+	slot_evict(lru);
+    }
+}
+
+/// Record an entry file of bytes for hash,
+/// in place of the least recently used of its probes if need be.
+/// Called with the index locked.
+static void
+index_insert(
+    guint64		hash,
+    guint64		bytes)
+{
+    Slot * slot = slot_find(hash);
+    if (slot) {
+	// its file has been replaced
+	disk.index->bytes -= MIN(slot->bytes, disk.index->bytes);
+    } else {
+	guint i;
+	for (i = 0; i < PROBES; ++i) {
+	    Slot * probe = disk.slots + (hash + i) % SLOTS;
+	    if (!probe->hash) {
+		slot = probe;
+		break;
+	    }
+	    if (!slot || probe->used < slot->used) {
+		slot = probe;
+	    }
+	}
+	if (slot->hash) {
+	    slot_evict(slot);
+	}
+    }
+    slot->hash = hash;
+    slot->used = ++disk.index->clock;
+    slot->written = slot->used;
+    slot->bytes = bytes;
+    disk.index->bytes += bytes;
+    index_evict(slot);
+}
+
+/// The NUL terminated string of length (with NUL) at offset in an entry file,
+/// or NULL
+static gchar const *
+entry_string(
+    gchar const *	contents,
+    gsize		offset,
+    gsize		length)
+{
+    return length && !contents[offset + length - 1] ? contents + offset : NULL;
+}
+
+/// Load the sample for key from an entry file, or NULL.
+/// Its buffer wraps the mapped file: entry files are only ever replaced
+/// (renamed over) or removed, never changed, so the mapping stays good.
+static GstSample *
+entry_load(
+    gchar const *	path,
+    gchar const *	key)
+{
+    GMappedFile * file = g_mapped_file_new(path, FALSE, NULL);
+    if (!file) {
+	return NULL;
+    }
+    gsize length = g_mapped_file_get_length(file);
+    gchar const * contents = g_mapped_file_get_contents(file);
+    Entry entry;
+    memset(&entry, 0, sizeof entry);
+    if (length >= sizeof entry) {
+	memcpy(&entry, contents, sizeof entry);
+    }
+    GstSample * sample = NULL;
+    gsize strings = (gsize) entry.key_length + entry.caps_length
+	+ entry.info_length;
+    if (ENTRY_MAGIC == entry.magic && VERSION == entry.version
+	    && sizeof entry + strings <= entry.offset
+	    && entry.offset <= length && entry.size <= length - entry.offset) {
+	gsize offset = sizeof entry;
+	gchar const * k = entry_string(contents, offset, entry.key_length);
+	offset += entry.key_length;
+	gchar const * c = entry_string(contents, offset, entry.caps_length);
+	offset += entry.caps_length;
+	gchar const * i = entry_string(contents, offset, entry.info_length);
+	GstCaps * caps = k && g_str_equal(k, key) && c
+	    ? gst_caps_from_string(c) : NULL;
+	if (caps) {
+	    GstBuffer * buffer = gst_buffer_new_wrapped_full(
+		GST_MEMORY_FLAG_READONLY, (gpointer) contents, length,
+		entry.offset, entry.size,
+		g_mapped_file_ref(file), (GDestroyNotify) g_mapped_file_unref);
+	    sample = gst_sample_new(buffer, caps, NULL,
+		i ? gst_structure_from_string(i, NULL) : NULL);
+	    gst_buffer_unref(buffer);
+	    gst_caps_unref(caps);
+	}
+    }
+    g_mapped_file_unref(file);
+    return sample;
+}
+
+void
+gst_add_tag_mux_disk_set_directory(
+    gchar const *	directory)
+{
+    disk_init();
+    GST_TRACE("> %s", directory);
+    disk_lock();
+    if (g_strcmp0(directory, disk.directory)) {
+	index_close();
+	if (directory && *directory) {
+	    index_open(directory);
+	}
+    }
+    g_mutex_unlock(&disk.mutex);
+    GST_TRACE("<");
+}
+
+gchar *
+gst_add_tag_mux_disk_get_directory(void)
+{
+    disk_lock();
+    gchar * ret = g_strdup(disk.directory);
+    g_mutex_unlock(&disk.mutex);
+    return ret;
+}
+
+void
+gst_add_tag_mux_disk_set_max_bytes(
+    guint64		max_bytes)
+{
+    disk_init();
+    GST_TRACE("> %" G_GUINT64_FORMAT, max_bytes);
+    disk_lock();
+    disk.max_bytes = max_bytes;
+    if (disk.index) {
+	flock(disk.fd, LOCK_EX);
+	index_evict(NULL);
+	flock(disk.fd, LOCK_UN);
+    }
+    g_mutex_unlock(&disk.mutex);
+    GST_TRACE("<");
+}
+
+guint64
+gst_add_tag_mux_disk_get_max_bytes(void)
+{
+    disk_lock();
+    guint64 ret = disk.max_bytes;
+    g_mutex_unlock(&disk.mutex);
+    return ret;
+}
+
+gboolean
+gst_add_tag_mux_disk_enabled(void)
+{
+    disk_lock();
+    gboolean ret = disk.index && disk.max_bytes;
+    g_mutex_unlock(&disk.mutex);
+    return ret;
+}
+
+GstSample *
+gst_add_tag_mux_disk_lookup(
+    gchar const *	key)
+{
+    disk_init();
+    GST_TRACE("> %s", key);
+    guint64 hash = key_hash(key);
+    gchar * path = NULL;
+    guint64 written = 0;
+    disk_lock();
+    if (disk.index) {
+	flock(disk.fd, LOCK_EX);
+	Slot * slot = slot_find(hash);
+	if (slot) {
+	    slot->used = ++disk.index->clock;
+	    written = slot->written;
+	    path = entry_path(disk.directory, hash);
+	}
+	flock(disk.fd, LOCK_UN);
+    }
+    g_mutex_unlock(&disk.mutex);
+
+    // the file is read without the lock
+    GstSample * ret = path ? entry_load(path, key) : NULL;
+    if (path && !ret) {
+	// lost, damaged or another key: forget it,
+	// unless it was written again (maybe by another process) meanwhile
+	// or the index was changed for another directory
+	GST_DEBUG("lost %s", path);
+	disk_lock();
+	gchar * current = disk.index
+	    ? entry_path(disk.directory, hash)
+	    : NULL;
+	if (current && g_str_equal(current, path)) {
+	    flock(disk.fd, LOCK_EX);
+	    Slot * slot = slot_find(hash);
+	    if (slot && written == slot->written) {
+		slot_evict(slot);
+	    }
+	    flock(disk.fd, LOCK_UN);
+	}
+	g_mutex_unlock(&disk.mutex);
+	g_free(current);
+    }
+    g_free(path);
+    GST_TRACE("< %p", ret);
+    return ret;
+}
+
+void
+gst_add_tag_mux_disk_insert(
+    gchar const *	key,
+    GstSample *		sample)
+{
+    disk_init();
+    GST_TRACE("> %s", key);
+    GstBuffer * buffer = gst_sample_get_buffer(sample);
+    GstCaps * caps = gst_sample_get_caps(sample);
+    GstStructure const * info = gst_sample_get_info(sample);
+    GstMapInfo map;
+    if (!buffer || !caps || !gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+	GST_TRACE("<");
+	return;
+    }
+    guint64 hash = key_hash(key);
+    disk_lock();
+    gchar * directory = disk.index ? g_strdup(disk.directory) : NULL;
+    guint64 max_bytes = disk.max_bytes;
+    g_mutex_unlock(&disk.mutex);
+
+    gchar * caps_string = gst_caps_to_string(caps);
+    gchar * info_string = info ? gst_structure_to_string(info) : NULL;
+    Entry entry;
+    memset(&entry, 0, sizeof entry);
+    entry.magic = ENTRY_MAGIC;
+    entry.version = VERSION;
+    entry.key_length = strlen(key) + 1;
+    entry.caps_length = strlen(caps_string) + 1;
+    entry.info_length = info_string ? strlen(info_string) + 1 : 0;
+    entry.offset = GST_ROUND_UP_16(sizeof entry
+	+ entry.key_length + entry.caps_length + entry.info_length);
+    entry.size = map.size;
+    gsize length = entry.offset + entry.size;
+    if (directory && length <= max_bytes) {
+	// written whole (to a temporary file, renamed) before it is indexed
+	gchar * contents = g_malloc0(length);
+	gsize offset = 0;
+	memcpy(contents + offset, &entry, sizeof entry);
+	offset += sizeof entry;
+	memcpy(contents + offset, key, entry.key_length);
+	offset += entry.key_length;
+	memcpy(contents + offset, caps_string, entry.caps_length);
+	offset += entry.caps_length;
+	if (info_string) {
+	    memcpy(contents + offset, info_string, entry.info_length);
+	}
+	memcpy(contents + entry.offset, map.data, map.size);
+	gchar * path = entry_path(directory, hash);
+	GError * error = NULL;
+	if (!g_file_set_contents(path, contents, length, &error)) {
+	    GST_WARNING("%s", error->message);
+	    g_error_free(error);
+	} else {
+	    disk_lock();
+	    if (disk.index && g_str_equal(directory, disk.directory)) {
+		flock(disk.fd, LOCK_EX);
+		index_insert(hash, length);
+		GST_DEBUG("insert %s %" G_GSIZE_FORMAT " bytes, %"
+		    G_GUINT64_FORMAT " total", path, length, disk.index->bytes);
+		flock(disk.fd, LOCK_UN);
+	    }
+	    g_mutex_unlock(&disk.mutex);
+	}
+	g_free(path);
+	g_free(contents);
+    }
+    g_free(info_string);
+    g_free(caps_string);
+    g_free(directory);
+    gst_buffer_unmap(buffer, &map);
+    GST_TRACE("<");
+}
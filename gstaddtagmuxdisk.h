@@ -0,0 +1,56 @@
+/* GStreamer
+ * Copyright (C) 2015 Ross Tyler
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifndef _GST_ADD_TAG_MUX_DISK_H_
+#define _GST_ADD_TAG_MUX_DISK_H_
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/// A process-wide cache, in a directory, of the GstSamples that we made
+/// (at some expense) from an image, shared by all addtagmux elements
+/// and by every process that uses the same directory.
+/// Each sample is kept in a file of its own
+/// and is looked up by a key that identifies the image and what was done.
+/// A compact index of them is memory-mapped (shared) from the directory
+/// and is only changed while it is locked (flock).
+/// The least recently used are evicted to keep within a size limit (bytes).
+/// No directory disables the cache.
+
+#define GST_ADD_TAG_MUX_DISK_DEFAULT_MAX_BYTES	(64 * 1024 * 1024)
+
+void		gst_add_tag_mux_disk_set_directory(gchar const * directory);
+gchar *		gst_add_tag_mux_disk_get_directory(void);
+void		gst_add_tag_mux_disk_set_max_bytes(guint64 max_bytes);
+guint64		gst_add_tag_mux_disk_get_max_bytes(void);
+gboolean	gst_add_tag_mux_disk_enabled(void);
+
+/// Returns a new sample for key, or NULL.
+/// Its buffer wraps the mapped file (without copying).
+GstSample *	gst_add_tag_mux_disk_lookup(gchar const * key);
+
+/// Keep (the buffer, caps and info of) sample for key
+void		gst_add_tag_mux_disk_insert(
+		    gchar const *	key,
+		    GstSample *		sample);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,146 @@
+/* GStreamer
+ * Copyright (C) 2015 Ross Tyler
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <sys/stat.h>
+
+#include <gst/gst.h>
+
+#include "gstaddtagmuxfolder.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_add_tag_mux_folder_debug_category);
+#define GST_CAT_DEFAULT gst_add_tag_mux_folder_debug_category
+
+#define MAX_FOLDERS	4096	// indexed before we start over
+
+typedef struct {
+    gint64		mtime;		// of folder when read, in ns
+    GPtrArray *		names;		// sorted
+} Folder;
+
+static struct {
+    GMutex		mutex;		// lock on everything below
+    GHashTable *	table;		// directory to Folder
+} folders;
+
+static void
+folder_free(
+    gpointer		data)
+{
+    Folder * folder = data;
+    g_ptr_array_unref(folder->names);
+    g_slice_free(Folder, folder);
+}
+
+/// Initialize our index (and our debug category) once, on first use,
+/// before anything is logged
+static void
+folders_init(void)
+{
+    static gsize init = 0;
+    if (g_once_init_enter(&init)) {
+	GST_DEBUG_CATEGORY_INIT(gst_add_tag_mux_folder_debug_category,
+	    "addtagmuxfolder", 0, "debug category for addtagmux folder index");
+	g_mutex_init(&folders.mutex);
+	folders.table = g_hash_table_new_full(g_str_hash, g_str_equal,
+	    g_free, folder_free);
+	g_once_init_leave(&init, 1);
+    }
+}
+
+/// Initialize our index, if need be, and return it locked
+static void
+folders_lock(void)
+{
+    folders_init();
+    g_mutex_lock(&folders.mutex);
+}
+
+/// The modification time of a directory, in ns.
+/// Whole seconds would miss a change in the same second that we read it.
+static gint64
+stat_mtime(
+    struct stat const *	st)
+{
+    return (gint64) st->st_mtim.tv_sec * GST_SECOND + st->st_mtim.tv_nsec;
+}
+
+static gint
+compare_names(
+    gconstpointer	a,
+    gconstpointer	b)
+{
+    return strcmp(*(gchar const * const *) a, *(gchar const * const *) b);
+}
+
+GPtrArray *
+gst_add_tag_mux_folder_list(
+    gchar const *	directory)
+{
+    folders_init();
+    GST_TRACE("> %s", directory);
+    struct stat st;
+    if (stat(directory, &st) || !S_ISDIR(st.st_mode)) {
+	GST_TRACE("< NULL");
+	return NULL;
+    }
+    folders_lock();
+    Folder * folder = g_hash_table_lookup(folders.table, directory);
+    GPtrArray * ret = folder && stat_mtime(&st) == folder->mtime
+	? g_ptr_array_ref(folder->names)
+	: NULL;
+    g_mutex_unlock(&folders.mutex);
+    if (ret) {
+	GST_TRACE("< %p", ret);
+	return ret;
+    }
+
+    // read without the lock.
+    // should the folder change as we do, its mtime will be newer
+    // than what we remember and it will be read again.
+    GDir * dir = g_dir_open(directory, 0, NULL);
+    if (!dir) {
+	GST_TRACE("< NULL");
+	return NULL;
+    }
+    ret = g_ptr_array_new_with_free_func(g_free);
+    gchar const * name;
+    while ((name = g_dir_read_name(dir))) {
+	g_ptr_array_add(ret, g_strdup(name));
+    }
+    g_dir_close(dir);
+    g_ptr_array_sort(ret, compare_names);
+    GST_DEBUG("%s: %u names", directory, ret->len);
+
+    folder = g_slice_new(Folder);
+    folder->mtime = stat_mtime(&st);
+    folder->names = g_ptr_array_ref(ret);
+    folders_lock();
+    if (MAX_FOLDERS <= g_hash_table_size(folders.table)) {
+	g_hash_table_remove_all(folders.table);
+    }
+    g_hash_table_replace(folders.table, g_strdup(directory), folder);
+    g_mutex_unlock(&folders.mutex);
+    GST_TRACE("< %p", ret);
+    return ret;
+}
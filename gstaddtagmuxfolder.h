@@ -0,0 +1,37 @@
+/* GStreamer
+ * Copyright (C) 2015 Ross Tyler
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifndef _GST_ADD_TAG_MUX_FOLDER_H_
+#define _GST_ADD_TAG_MUX_FOLDER_H_
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/// A process-wide index of the names in folders (directories),
+/// shared by all addtagmux elements,
+/// so that the songs of an album read their folder once.
+/// A folder is read again when its modification time changes.
+
+/// Returns a new reference to the names (sorted) in directory, or NULL
+GPtrArray *	gst_add_tag_mux_folder_list(gchar const * directory);
+
+G_END_DECLS
+
+#endif
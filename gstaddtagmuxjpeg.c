@@ -0,0 +1,401 @@
+/* GStreamer
+ * Copyright (C) 2015 Ross Tyler
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+#include <gst/gst.h>
+
+#include "gstaddtagmuxjpeg.h"
+
+GST_DEBUG_CATEGORY_STATIC(gst_add_tag_mux_jpeg_debug_category);
+#define GST_CAT_DEFAULT gst_add_tag_mux_jpeg_debug_category
+
+#define QUALITY		85	// of images we encode
+
+/// Our libjpeg error manager
+/// and what must survive a longjmp from it
+typedef struct {
+    struct jpeg_error_mgr	mgr;		// first, as cinfo->err
+    jmp_buf			jmp;		// back to where we started
+    guint8 *			pixels;		// decoded
+    unsigned char *		data;		// encoded, malloc'ed by libjpeg
+    unsigned long		size;		// of encoded data
+} Context;
+
+/// An image decoded (and scaled) into pixels
+typedef struct {
+    guint8 *		pixels;		// rows of components
+    guint		width;		// decoded
+    guint		height;
+    guint		components;	// per pixel
+    guint		fit_width;	// to fit
+    guint		fit_height;
+} Image;
+
+static void
+jpeg_init(void)
+{
+    static gsize init = 0;
+    if (g_once_init_enter(&init)) {
+	GST_DEBUG_CATEGORY_INIT(gst_add_tag_mux_jpeg_debug_category,
+	    "addtagmuxjpeg", 0, "debug category for addtagmux jpeg scaling");
+	g_once_init_leave(&init, 1);
+    }
+}
+
+/// libjpeg can't continue; neither can we
+static void
+context_error_exit(
+    j_common_ptr	cinfo)
+{
+    char message[JMSG_LENGTH_MAX];
+    cinfo->err->format_message(cinfo, message);
+    GST_WARNING("%s", message);
+    longjmp(((Context *) cinfo->err)->jmp, 1);
+}
+
+/// libjpeg can continue; we only log it
+static void
+context_output_message(
+    j_common_ptr	cinfo)
+{
+    char message[JMSG_LENGTH_MAX];
+    cinfo->err->format_message(cinfo, message);
+    GST_DEBUG("%s", message);
+}
+
+static void
+context_init(
+    Context *		context)
+{
+    jpeg_std_error(&context->mgr);
+    context->mgr.error_exit = context_error_exit;
+    context->mgr.output_message = context_output_message;
+    context->pixels = NULL;
+    context->data = NULL;
+    context->size = 0;
+}
+
+/// Fit width x height within max_width x max_height (0 is unlimited),
+/// keeping the aspect ratio.
+/// Return FALSE if it already fits.
+static gboolean
+fit(
+    guint		width,
+    guint		height,
+    guint		max_width,
+    guint		max_height,
+    guint *		fit_width,
+    guint *		fit_height)
+{
+    guint w = width;
+    guint h = height;
+    if (max_width && w > max_width) {
+	h = MAX(1, (guint64) h * max_width / w);
+	w = max_width;
+    }
+    if (max_height && h > max_height) {
+	w = MAX(1, (guint64) w * max_height / h);
+	h = max_height;
+    }
+    *fit_width = w;
+    *fit_height = h;
+    return w != width || h != height;
+}
+
+/// Decode a JPEG image that does not fit,
+/// as small as libjpeg can (1/1, 1/2, 1/4 or 1/8) without going under.
+static gboolean
+decode(
+    guint8 const *	data,
+    gsize		size,
+    guint		max_width,
+    guint		max_height,
+    Image *		image)
+{
+    struct jpeg_decompress_struct cinfo;
+    Context context;
+    context_init(&context);
+    cinfo.err = &context.mgr;
+    if (setjmp(context.jmp)) {
+	jpeg_destroy_decompress(&cinfo);
+	g_free(context.pixels);
+	return FALSE;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, data, size);
+    jpeg_read_header(&cinfo, TRUE);
+    if (JCS_CMYK == cinfo.jpeg_color_space
+	    || JCS_YCCK == cinfo.jpeg_color_space
+	    || !fit(cinfo.image_width, cinfo.image_height,
+		max_width, max_height,
+		&image->fit_width, &image->fit_height)) {
+	jpeg_destroy_decompress(&cinfo);
+	return FALSE;
+    }
+    guint denom = 8;
+    while (denom > 1
+	    && ((cinfo.image_width + denom - 1) / denom < image->fit_width
+		|| (cinfo.image_height + denom - 1) / denom
+		    < image->fit_height)) {
+	denom /= 2;
+    }
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = denom;
+    cinfo.out_color_space = JCS_GRAYSCALE == cinfo.jpeg_color_space
+	? JCS_GRAYSCALE : JCS_RGB;
+    cinfo.dct_method = JDCT_ISLOW;
+    jpeg_start_decompress(&cinfo);
+    GST_DEBUG("%ux%u 1/%u %ux%u to %ux%u",
+	cinfo.image_width, cinfo.image_height, denom,
+	cinfo.output_width, cinfo.output_height,
+	image->fit_width, image->fit_height);
+    gsize stride = (gsize) cinfo.output_width * cinfo.output_components;
+    context.pixels = g_malloc(stride * cinfo.output_height);
+    while (cinfo.output_scanline < cinfo.output_height) {
+	JSAMPROW row = context.pixels + stride * cinfo.output_scanline;
+	jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    image->pixels = context.pixels;
+    image->width = cinfo.output_width;
+    image->height = cinfo.output_height;
+    image->components = cinfo.output_components;
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return TRUE;
+}
+
+/// For each of n destination samples, the first of the two source samples
+/// (of m) that it is interpolated from and the weight (in 256ths)
+/// of the second.
+static void
+taps(
+    guint		m,
+    guint		n,
+    guint *		first,
+    guint *		weight)
+{
+    guint i;
+    for (i = 0; i < n; ++i) {
+	// center of destination sample in source, in 256ths
+	gint64 s = ((gint64) (2 * i + 1) * m * 256) / (2 * n) - 128;
+	if (s < 0) {
+	    s = 0;
+	}
+	first[i] = s >> 8;
+	weight[i] = s & 255;
+	if (first[i] + 1 >= m) {
+	    first[i] = m - 1;
+	    weight[i] = 0;
+	}
+    }
+}
+
+/// For each of n destination samples, the first of the source samples
+/// (of m) that it averages; it averages those up to the first of the next
+/// (first[n] is m).
+/// Where we shrink by 2 or more, each averages at least two.
+static void
+boxes(
+    guint		m,
+    guint		n,
+    guint *		first)
+{
+    guint i;
+    for (i = 0; i <= n; ++i) {
+	first[i] = (guint64) i * m / n;
+    }
+}
+
+/// Resize an image to fit, a pass for each axis.
+/// DCT scaling does no more than 1/8, so it may leave us to shrink
+/// by 2 or more (say 4000 to 160, or 375 to 160 if it was not used).
+/// Where we shrink by less than 2, we interpolate linearly (two taps);
+/// otherwise we average the (box of) samples each covers
+/// so none are skipped.
+/// The vertical pass runs over contiguous rows with the same weight,
+/// which the compiler can vectorize.
+static void
+resize(
+    Image *		image)
+{
+    guint c = image->components;
+    guint sw = image->width;
+    guint sh = image->height;
+    guint dw = image->fit_width;
+    guint dh = image->fit_height;
+    gsize sstride = (gsize) sw * c;
+    gsize dstride = (gsize) dw * c;
+    guint * first = g_new(guint, MAX(dw, dh) + 1);
+    guint * weight = g_new(guint, MAX(dw, dh));
+    guint x, y, k;
+
+    // horizontally, sw x sh to dw x sh
+    guint8 * across = g_malloc(dstride * sh);
+    if (sw >= 2 * dw) {
+	boxes(sw, dw, first);
+	for (y = 0; y < sh; ++y) {
+	    guint8 const * src = image->pixels + sstride * y;
+	    guint8 * dst = across + dstride * y;
+	    for (x = 0; x < dw; ++x) {
+		guint n = first[x + 1] - first[x];
+		for (k = 0; k < c; ++k) {
+		    guint8 const * a = src + first[x] * c + k;
+		    guint sum = 0;
+		    guint j;
+		    for (j = 0; j < n; ++j, a += c) {
+			sum += *a;
+		    }
+		    *dst++ = (sum + n / 2) / n;
+		}
+	    }
+	}
+    } else {
+	taps(sw, dw, first, weight);
+	for (y = 0; y < sh; ++y) {
+	    guint8 const * src = image->pixels + sstride * y;
+	    guint8 * dst = across + dstride * y;
+	    for (x = 0; x < dw; ++x) {
+		guint8 const * a = src + first[x] * c;
+		guint8 const * b = weight[x] ? a + c : a;
+		guint w = weight[x];
+		for (k = 0; k < c; ++k) {
+		    *dst++ = (a[k] * (256 - w) + b[k] * w + 128) >> 8;
+		}
+	    }
+	}
+    }
+    g_free(image->pixels);
+
+    // vertically, dw x sh to dw x dh
+    image->pixels = g_malloc(dstride * dh);
+    gsize i;
+    if (sh >= 2 * dh) {
+	guint * sum = g_new(guint, dstride);
+	boxes(sh, dh, first);
+	for (y = 0; y < dh; ++y) {
+	    guint n = first[y + 1] - first[y];
+	    guint8 const * a = across + dstride * first[y];
+	    memset(sum, 0, dstride * sizeof *sum);
+	    guint j;
+	    for (j = 0; j < n; ++j, a += dstride) {
+		for (i = 0; i < dstride; ++i) {
+		    sum[i] += a[i];
+		}
+	    }
+	    guint8 * dst = image->pixels + dstride * y;
+	    for (i = 0; i < dstride; ++i) {
+		dst[i] = (sum[i] + n / 2) / n;
+	    }
+	}
+	g_free(sum);
+    } else {
+	taps(sh, dh, first, weight);
+	for (y = 0; y < dh; ++y) {
+	    guint8 const * a = across + dstride * first[y];
+	    guint8 const * b = weight[y] ? a + dstride : a;
+	    guint w = weight[y];
+	    guint8 * dst = image->pixels + dstride * y;
+	    for (i = 0; i < dstride; ++i) {
+		dst[i] = (a[i] * (256 - w) + b[i] * w + 128) >> 8;
+	    }
+	}
+    }
+    g_free(across);
+    g_free(weight);
+    g_free(first);
+
+    image->width = dw;
+    image->height = dh;
+}
+
+/// Encode an image as JPEG
+static GstBuffer *
+encode(
+    Image *		image)
+{
+    struct jpeg_compress_struct cinfo;
+    Context context;
+    context_init(&context);
+    cinfo.err = &context.mgr;
+    if (setjmp(context.jmp)) {
+	jpeg_destroy_compress(&cinfo);
+	free(context.data);
+	return NULL;
+    }
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &context.data, &context.size);
+    cinfo.image_width = image->width;
+    cinfo.image_height = image->height;
+    cinfo.input_components = image->components;
+    cinfo.in_color_space = 1 == image->components ? JCS_GRAYSCALE : JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, QUALITY, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    gsize stride = (gsize) image->width * image->components;
+    while (cinfo.next_scanline < cinfo.image_height) {
+	JSAMPROW row = image->pixels + stride * cinfo.next_scanline;
+	jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return gst_buffer_new_wrapped_full(0, context.data, context.size,
+	0, context.size, context.data, free);
+}
+
+GstBuffer *
+gst_add_tag_mux_jpeg_scale(
+    GstBuffer *		buffer,
+    guint		max_width,
+    guint		max_height)
+{
+    if (!max_width && !max_height) {
+	return NULL;
+    }
+    jpeg_init();
+    GST_TRACE("> %ux%u", max_width, max_height);
+    GstMapInfo map;
+    if (!gst_buffer_map(buffer, &map, GST_MAP_READ)) {
+	GST_TRACE("< NULL");
+	return NULL;
+    }
+    Image image;
+    gboolean decoded = decode(map.data, map.size, max_width, max_height,
+	&image);
+    gst_buffer_unmap(buffer, &map);
+    if (!decoded) {
+	GST_TRACE("< NULL");
+	return NULL;
+    }
+    if (image.width != image.fit_width || image.height != image.fit_height) {
+	resize(&image);
+    }
+    GstBuffer * ret = encode(&image);
+    g_free(image.pixels);
+    GST_TRACE("< %p", ret);
+    return ret;
+}
@@ -0,0 +1,39 @@
+/* GStreamer
+ * Copyright (C) 2015 Ross Tyler
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifndef _GST_ADD_TAG_MUX_JPEG_H_
+#define _GST_ADD_TAG_MUX_JPEG_H_
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+/// Scale a JPEG image down to fit within max_width x max_height
+/// (0 is unlimited), keeping its aspect ratio.
+/// The image is decoded at 1/2, 1/4 or 1/8 of its size by libjpeg
+/// (in the DCT domain) then resized the rest of the way and encoded again.
+/// Returns a new buffer or NULL if the image already fits (or is not one).
+GstBuffer *	gst_add_tag_mux_jpeg_scale(
+		    GstBuffer *		buffer,
+		    guint		max_width,
+		    guint		max_height);
+
+G_END_DECLS
+
+#endif
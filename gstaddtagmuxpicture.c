@@ -0,0 +1,119 @@
+/* GStreamer
+ * Copyright (C) 2015 Ross Tyler
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <gst/gst.h>
+
+#include "gstaddtagmuxpicture.h"
+
+#define PREFIX	"METADATA_BLOCK_PICTURE="
+
+/// The length of a FLAC metadata block is 24 bits
+#define MAX_BLOCK_SIZE	0xffffff
+
+static gchar const alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/// Base64 encode, without the line breaks or state of g_base64_encode.
+/// Each 3 bytes are taken as 4 independent 6 bit table lookups,
+/// which the compiler can unroll and interleave.
+/// Returns the end of what was written.
+static gchar *
+base64(
+    guint8 const *	data,
+    gsize		size,
+    gchar *		out)
+{
+    gsize i;
+    for (i = 0; i + 3 <= size; i += 3) {
+	guint32 v = (guint32) data[i] << 16 | (guint32) data[i + 1] << 8
+	    | data[i + 2];
+	out[0] = alphabet[v >> 18];
+	out[1] = alphabet[v >> 12 & 63];
+	out[2] = alphabet[v >> 6 & 63];
+	out[3] = alphabet[v & 63];
+	out += 4;
+    }
+    if (i < size) {
+	guint32 v = (guint32) data[i] << 16;
+	if (i + 1 < size) {
+	    v |= (guint32) data[i + 1] << 8;
+	}
+	out[0] = alphabet[v >> 18];
+	out[1] = alphabet[v >> 12 & 63];
+	out[2] = i + 1 < size ? alphabet[v >> 6 & 63] : '=';
+	out[3] = '=';
+	out += 4;
+    }
+    return out;
+}
+
+static guint8 *
+be32(
+    guint8 *		p,
+    guint32		v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+    return p + 4;
+}
+
+gchar *
+gst_add_tag_mux_picture_comment(
+    guint8 const *	data,
+    gsize		size,
+    gchar const *	mime,
+    GstTagImageType	image_type,
+    guint		width,
+    guint		height)
+{
+    // picture type (as ID3v2 APIC), mime type, description (none),
+    // width, height, depth and colors (unknown), data
+    gsize mime_size = strlen(mime);
+    gsize block_size = 4 + 4 + mime_size + 4 + 4 * 4 + 4 + size;
+    if (block_size > MAX_BLOCK_SIZE) {
+	return NULL;
+    }
+    guint8 * block = g_malloc(block_size);
+    guint8 * p = be32(block,
+	GST_TAG_IMAGE_TYPE_UNDEFINED < image_type ? image_type + 2 : 0);
+    p = be32(p, mime_size);
+    memcpy(p, mime, mime_size);
+    p += mime_size;
+    p = be32(p, 0);
+    p = be32(p, width);
+    p = be32(p, height);
+    p = be32(p, 0);
+    p = be32(p, 0);
+    p = be32(p, size);
+    memcpy(p, data, size);
+
+    gchar * ret = g_malloc(sizeof PREFIX - 1 + (block_size + 2) / 3 * 4 + 1);
+    memcpy(ret, PREFIX, sizeof PREFIX - 1);
+    *base64(block, block_size, ret + sizeof PREFIX - 1) = '\0';
+    g_free(block);
+    return ret;
+}
@@ -0,0 +1,45 @@
+/* GStreamer
+ * Copyright (C) 2015 Ross Tyler
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifndef _GST_ADD_TAG_MUX_PICTURE_H_
+#define _GST_ADD_TAG_MUX_PICTURE_H_
+
+#include <gst/gst.h>
+#include <gst/tag/tag.h>
+
+G_BEGIN_DECLS
+
+/// Serialize an image as a FLAC PICTURE metadata block, base64-encoded
+/// in a vorbis comment (METADATA_BLOCK_PICTURE=...),
+/// as a string for a GST_TAG_EXTENDED_COMMENT tag.
+/// A vorbis comment writer writes this as is
+/// rather than encoding an image tag itself.
+/// width and height may be 0 when unknown.
+/// Returns NULL if the image is too big for a metadata block.
+gchar *		gst_add_tag_mux_picture_comment(
+		    guint8 const *	data,
+		    gsize		size,
+		    gchar const *	mime,
+		    GstTagImageType	image_type,
+		    guint		width,
+		    guint		height);
+
+G_END_DECLS
+
+#endif
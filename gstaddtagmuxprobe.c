@@ -0,0 +1,189 @@
+/* GStreamer
+ * Copyright (C) 2015 Ross Tyler
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include <gst/gst.h>
+
+#include "gstaddtagmuxprobe.h"
+
+#define BE16(p)	((guint) (p)[0] << 8 | (p)[1])
+#define BE24(p)	((guint) (p)[0] << 16 | (guint) (p)[1] << 8 | (p)[2])
+#define BE32(p)	((guint) (p)[0] << 24 | (guint) (p)[1] << 16 \
+		    | (guint) (p)[2] << 8 | (p)[3])
+
+/// Walk JPEG markers (skipping segments) to the first start of frame
+static gboolean
+probe_jpeg(
+    guint8 const *	data,
+    gsize		size,
+    GstAddTagMuxProbe *	probe)
+{
+    gsize i = 2;			// after SOI
+    while (i + 4 <= size) {
+	if (0xff != data[i]) {
+	    return FALSE;
+	}
+	guint8 marker = data[i + 1];
+	if (0xff == marker) {		// fill
+	    ++i;
+	    continue;
+	}
+	if (0x01 == marker || (0xd0 <= marker && marker <= 0xd7)) {
+	    i += 2;			// no segment
+	    continue;
+	}
+	if (0xd9 == marker || 0xda == marker) {
+	    return FALSE;		// EOI or SOS before SOF
+	}
+	guint length = BE16(data + i + 2);
+	if (0xc0 <= marker && marker <= 0xcf
+		&& 0xc4 != marker && 0xc8 != marker && 0xcc != marker) {
+	    // SOFn: length, precision, height, width, components
+	    if (i + 10 > size) {
+		return FALSE;
+	    }
+	    probe->height = BE16(data + i + 5);
+	    probe->width = BE16(data + i + 7);
+	    probe->channels = data[i + 9];
+	    probe->progressive = 0xc2 == marker || 0xc6 == marker
+		|| 0xca == marker || 0xce == marker;
+	    return TRUE;
+	}
+	i += 2 + length;
+    }
+    return FALSE;
+}
+
+/// Read the IHDR chunk, which must come first
+static gboolean
+probe_png(
+    guint8 const *	data,
+    gsize		size,
+    GstAddTagMuxProbe *	probe)
+{
+    // signature, length, IHDR, width, height, depth, color, ..., interlace
+    if (size < 8 + 8 + 13 || memcmp(data + 12, "IHDR", 4)) {
+	return FALSE;
+    }
+    static guint const channels[] = {1, 0, 3, 1, 2, 0, 4};
+    guint8 color = data[25];
+    if (color >= G_N_ELEMENTS(channels) || !channels[color]) {
+	return FALSE;
+    }
+    probe->width = BE32(data + 16);
+    probe->height = BE32(data + 20);
+    probe->channels = channels[color];
+    probe->progressive = 1 == data[28];
+    return TRUE;
+}
+
+gboolean
+gst_add_tag_mux_probe(
+    guint8 const *	data,
+    gsize		size,
+    GstAddTagMuxProbe *	probe)
+{
+    static guint8 const png[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    if (size >= 2 && 0xff == data[0] && 0xd8 == data[1]) {
+	return probe_jpeg(data, size, probe);
+    }
+    if (size >= sizeof png && !memcmp(data, png, sizeof png)) {
+	return probe_png(data, size, probe);
+    }
+    return FALSE;
+}
+
+void
+gst_add_tag_mux_flac_scan_init(
+    GstAddTagMuxFlacScan *	scan)
+{
+    scan->offset = 0;
+    scan->next = 0;
+    scan->have = 0;
+    scan->magic = FALSE;
+}
+
+/// Skip to the block after the one whose header we have.
+/// Return TRUE if it was the last.
+static gboolean
+flac_scan_skip(
+    GstAddTagMuxFlacScan *	scan)
+{
+    scan->next += 4 + BE24(scan->header + 1);
+    scan->have = 0;
+    return 0x80 & scan->header[0];
+}
+
+GstAddTagMuxFlacScanResult
+gst_add_tag_mux_flac_scan(
+    GstAddTagMuxFlacScan *	scan,
+    guint8 const *		data,
+    gsize			size,
+    GstTagImageType		image_type)
+{
+    gsize i = 0;
+    while (i < size) {
+	if (scan->offset < scan->next) {
+	    gsize skip = MIN(scan->next - scan->offset, size - i);
+	    i += skip;
+	    scan->offset += skip;
+	    continue;
+	}
+	scan->header[scan->have++] = data[i++];
+	++scan->offset;
+	if (!scan->magic) {
+	    if (4 == scan->have) {
+		if (memcmp(scan->header, "fLaC", 4)) {
+		    return GST_ADD_TAG_MUX_FLAC_SCAN_ABSENT;
+		}
+		scan->magic = TRUE;
+		scan->have = 0;
+		scan->next = scan->offset;
+	    }
+	} else if (4 == scan->have) {
+	    // last flag, block type and length
+	    guint type = 0x7f & scan->header[0];
+	    if (127 == type) {
+		return GST_ADD_TAG_MUX_FLAC_SCAN_ABSENT;
+	    }
+	    if (6 != type && flac_scan_skip(scan)) {
+		return GST_ADD_TAG_MUX_FLAC_SCAN_ABSENT;
+	    }
+	} else if (8 == scan->have) {
+	    // PICTURE type is that of an ID3v2 APIC frame:
+	    // 0 is other, 1 and 2 are file icons, then as GstTagImageType
+	    guint type = BE32(scan->header + 4);
+	    GstTagImageType found = 3 <= type ? (GstTagImageType) (type - 2)
+		: 0 == type ? GST_TAG_IMAGE_TYPE_UNDEFINED
+		: GST_TAG_IMAGE_TYPE_NONE;
+	    if (GST_TAG_IMAGE_TYPE_NONE != found && image_type == found) {
+		return GST_ADD_TAG_MUX_FLAC_SCAN_FOUND;
+	    }
+	    if (flac_scan_skip(scan)) {
+		return GST_ADD_TAG_MUX_FLAC_SCAN_ABSENT;
+	    }
+	}
+    }
+    return GST_ADD_TAG_MUX_FLAC_SCAN_MORE;
+}
@@ -0,0 +1,72 @@
+/* GStreamer
+ * Copyright (C) 2015 Ross Tyler
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifndef _GST_ADD_TAG_MUX_PROBE_H_
+#define _GST_ADD_TAG_MUX_PROBE_H_
+
+#include <gst/gst.h>
+#include <gst/tag/tag.h>
+
+G_BEGIN_DECLS
+
+/// What the header of an image says about it
+typedef struct {
+    guint		width;
+    guint		height;
+    guint		channels;	// components per pixel
+    gboolean		progressive;	// (JPEG) or interlaced (PNG)
+} GstAddTagMuxProbe;
+
+/// Probe the header of a JPEG (SOF) or PNG (IHDR) image, without decoding.
+/// Returns FALSE if it is neither.
+gboolean	gst_add_tag_mux_probe(
+		    guint8 const *	data,
+		    gsize		size,
+		    GstAddTagMuxProbe *	probe);
+
+/// Where a scan of a FLAC stream for PICTURE metadata blocks is
+typedef struct {
+    guint64		offset;		// of the next byte scanned
+    guint64		next;		// offset of the next block (header)
+    guint8		header[8];	// of a block, then its picture type
+    guint		have;		// bytes of header
+    gboolean		magic;		// fLaC seen
+} GstAddTagMuxFlacScan;
+
+typedef enum {
+    GST_ADD_TAG_MUX_FLAC_SCAN_MORE,	// feed more
+    GST_ADD_TAG_MUX_FLAC_SCAN_FOUND,	// a picture of the image-type
+    GST_ADD_TAG_MUX_FLAC_SCAN_ABSENT,	// none before the audio (or not FLAC)
+} GstAddTagMuxFlacScanResult;
+
+void		gst_add_tag_mux_flac_scan_init(
+		    GstAddTagMuxFlacScan *	scan);
+
+/// Scan the next bytes of a FLAC stream, from its start,
+/// for a PICTURE metadata block of an image-type.
+/// Only block headers are read; the blocks themselves are skipped.
+GstAddTagMuxFlacScanResult	gst_add_tag_mux_flac_scan(
+		    GstAddTagMuxFlacScan *	scan,
+		    guint8 const *		data,
+		    gsize			size,
+		    GstTagImageType		image_type);
+
+G_END_DECLS
+
+#endif
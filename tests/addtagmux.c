@@ -0,0 +1,309 @@
+/* GStreamer
+ * Copyright (C) 2015 Ross Tyler
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+/// Unit and stress tests of the addtagmux element (make check).
+/// The main stream is driven through a GstHarness
+/// and each additional stream by a src pad of our own
+/// linked to a requested sink_%u pad.
+
+#include <string.h>
+
+#include <gst/check/gstcheck.h>
+#include <gst/check/gstharness.h>
+#include <gst/tag/tag.h>
+
+/// An additional stream, from our src pad to a requested sink pad
+typedef struct {
+    GstPad *		src;		// ours, or NULL if never linked
+    GstPad *		sink;		// requested
+} Side;
+
+/// Request a sink pad of a priority
+/// and, if linked, link our src pad to it and start a JPEG stream
+static Side
+side_new(
+    GstElement *	element,
+    gint		priority,
+    gboolean		linked)
+{
+    Side side;
+    GstPadTemplate * template
+	= gst_element_get_pad_template(element, "sink_%u");
+    side.sink = gst_element_request_pad(element, template, NULL, NULL);
+    fail_unless(side.sink != NULL);
+    g_object_set(side.sink, "priority", priority, NULL);
+    side.src = NULL;
+    if (linked) {
+	side.src = gst_pad_new(NULL, GST_PAD_SRC);
+	gst_pad_set_active(side.src, TRUE);
+	fail_unless_equals_int(GST_PAD_LINK_OK,
+	    gst_pad_link(side.src, side.sink));
+	gst_pad_push_event(side.src, gst_event_new_stream_start("side"));
+	gst_pad_push_event(side.src,
+	    gst_event_new_caps(gst_caps_new_empty_simple("image/jpeg")));
+	GstSegment segment;
+	gst_segment_init(&segment, GST_FORMAT_BYTES);
+	gst_pad_push_event(side.src, gst_event_new_segment(&segment));
+    }
+    return side;
+}
+
+/// Push an "image" of size bytes, each of value.
+/// With trusted (fixed) caps it is taken as is.
+static GstFlowReturn
+side_push(
+    Side *		side,
+    guint8		value,
+    gsize		size)
+{
+    GstBuffer * buffer = gst_buffer_new_allocate(NULL, size, NULL);
+    gst_buffer_memset(buffer, 0, value, size);
+    return gst_pad_push(side->src, buffer);
+}
+
+static void
+side_eos(
+    Side *		side)
+{
+    gst_pad_push_event(side->src, gst_event_new_eos());
+}
+
+/// Release the sink pad (which unlinks it) and free our src pad
+static void
+side_release(
+    GstElement *	element,
+    Side *		side)
+{
+    gst_element_release_request_pad(element, side->sink);
+    gst_object_unref(side->sink);
+    if (side->src) {
+	gst_pad_set_active(side->src, FALSE);
+	gst_object_unref(side->src);
+    }
+}
+
+/// A main stream harness (in PLAYING) that we have yet to start
+static GstHarness *
+main_new(void)
+{
+    GstHarness * h = gst_harness_new_with_padnames("addtagmux",
+	"sink", "src");
+    gst_harness_play(h);
+    return h;
+}
+
+static void
+main_start(
+    GstHarness *	h)
+{
+    gst_harness_set_src_caps_str(h, "audio/x-raw");
+}
+
+/// The first image of each tag event pulled from the main stream, in order,
+/// as the value of its bytes
+static GString *
+main_images(
+    GstHarness *	h)
+{
+    GString * images = g_string_new(NULL);
+    GstEvent * event;
+    while ((event = gst_harness_try_pull_event(h))) {
+	if (GST_EVENT_TAG == GST_EVENT_TYPE(event)) {
+	    GstTagList * taglist;
+	    gst_event_parse_tag(event, &taglist);
+	    guint i, n = gst_tag_list_get_tag_size(taglist, GST_TAG_IMAGE);
+	    for (i = 0; i < n; ++i) {
+		GstSample * sample;
+		if (gst_tag_list_get_sample_index(taglist, GST_TAG_IMAGE, i,
+			&sample)) {
+		    guint8 value;
+		    gst_buffer_extract(gst_sample_get_buffer(sample), 0,
+			&value, 1);
+		    g_string_append_c(images, value);
+		    gst_sample_unref(sample);
+		}
+	    }
+	}
+	gst_event_unref(event);
+    }
+    return images;
+}
+
+/// Pads requested and released, linked or not, change nothing
+GST_START_TEST(test_request_release)
+{
+    GstElement * element = gst_element_factory_make("addtagmux", NULL);
+    fail_unless(element != NULL);
+    guint i;
+    for (i = 0; i < 5000; ++i) {
+	Side side = side_new(element, 0, i & 1);
+	side_release(element, &side);
+    }
+    GstPadTemplate * template
+	= gst_element_get_pad_template(element, "main_sink_%u");
+    for (i = 0; i < 1000; ++i) {
+	GstPad * pad = gst_element_request_pad(element, template, NULL, NULL);
+	fail_unless(pad != NULL);
+	gst_element_release_request_pad(element, pad);
+	gst_object_unref(pad);
+    }
+    fail_unless_equals_int(1, element->numsinkpads);
+    fail_unless_equals_int(1, element->numsrcpads);
+    gst_object_unref(element);
+}
+GST_END_TEST;
+
+/// Streams that end, are released while pending, are flushed
+/// or are never linked all settle, while the main stream is held
+/// (for thousands of pads), and it is then released with the tags of
+/// those that ended.
+GST_START_TEST(test_release_under_load)
+{
+    GstHarness * h = main_new();
+    GstElement * element = h->element;
+    // never wait on a full queue, only on the streams at EOS
+    g_object_set(element, "max-size-buffers", 0, "max-size-bytes", 0,
+	"max-size-time", (guint64) 0, NULL);
+    Side anchor = side_new(element, 0, TRUE);
+    main_start(h);
+
+    guint pushed = 0;
+    guint ended = 0;
+    guint i;
+    for (i = 0; i < 3000; ++i) {
+	guint mode = i % 4;
+	Side side = side_new(element, 0, 0 != mode);
+	if (mode) {
+	    fail_unless_equals_int(GST_FLOW_OK, side_push(&side, 'a', 16));
+	}
+	if (2 == mode) {
+	    side_eos(&side);
+	    ++ended;
+	} else if (3 == mode) {
+	    gst_pad_push_event(side.src, gst_event_new_flush_start());
+	    gst_pad_push_event(side.src, gst_event_new_flush_stop(TRUE));
+	}
+	side_release(element, &side);
+	if (!(i % 10)) {
+	    fail_unless_equals_int(GST_FLOW_OK,
+		gst_harness_push(h, gst_buffer_new_allocate(NULL, 64, NULL)));
+	    ++pushed;
+	}
+    }
+    // nothing is released until the anchor ends
+    fail_unless_equals_int(0, gst_harness_buffers_received(h));
+    side_eos(&anchor);
+    fail_unless(gst_harness_push_event(h, gst_event_new_eos()));
+    fail_unless_equals_int(pushed, gst_harness_buffers_received(h));
+
+    GString * images = main_images(h);
+    fail_unless_equals_int(ended, images->len);
+    g_string_free(images, TRUE);
+    side_release(element, &anchor);
+    gst_harness_teardown(h);
+}
+GST_END_TEST;
+
+/// A stream released after it ended is merged by priority
+/// and request order, like one that was not
+GST_START_TEST(test_released_order)
+{
+    GstHarness * h = main_new();
+    GstElement * element = h->element;
+    Side low = side_new(element, 0, TRUE);
+    Side high = side_new(element, 1, TRUE);
+    Side next = side_new(element, 0, TRUE);
+    main_start(h);
+    side_push(&low, 'c', 16);
+    side_eos(&low);
+    side_release(element, &low);
+    side_push(&next, 'd', 16);
+    side_eos(&next);
+    side_push(&high, 'b', 16);
+    side_eos(&high);
+    fail_unless_equals_int(GST_FLOW_OK,
+	gst_harness_push(h, gst_buffer_new_allocate(NULL, 64, NULL)));
+
+    GString * images = main_images(h);
+    fail_unless_equals_string("bcd", images->str);
+    g_string_free(images, TRUE);
+    side_release(element, &high);
+    side_release(element, &next);
+    gst_harness_teardown(h);
+}
+GST_END_TEST;
+
+/// A stream whose upstream posts an error, without EOS, is not waited for
+GST_START_TEST(test_upstream_error)
+{
+    GstElement * element = gst_element_factory_make("addtagmux", NULL);
+    fail_unless(element != NULL);
+    GstBus * bus = gst_bus_new();
+    gst_element_set_bus(element, bus);
+    GstHarness * h = gst_harness_new_with_element(element, "sink", "src");
+    gst_harness_play(h);
+
+    // a source in an upstream bin that fails to start
+    GstElement * upstream = gst_bin_new("upstream");
+    gst_element_set_bus(upstream, bus);
+    GstPad * src = gst_pad_new("src", GST_PAD_SRC);
+    gst_element_add_pad(upstream, src);
+    Side side;
+    GstPadTemplate * template
+	= gst_element_get_pad_template(element, "sink_%u");
+    side.sink = gst_element_request_pad(element, template, NULL, NULL);
+    side.src = NULL;
+    fail_unless_equals_int(GST_PAD_LINK_OK, gst_pad_link(src, side.sink));
+    main_start(h);
+    fail_unless_equals_int(GST_FLOW_OK,
+	gst_harness_push(h, gst_buffer_new_allocate(NULL, 64, NULL)));
+    fail_unless_equals_int(0, gst_harness_buffers_received(h));
+
+    GError * error = g_error_new(GST_RESOURCE_ERROR,
+	GST_RESOURCE_ERROR_NOT_FOUND, "not found");
+    gst_element_post_message(upstream,
+	gst_message_new_error(GST_OBJECT(upstream), error, NULL));
+    g_error_free(error);
+    fail_unless(gst_harness_push_event(h, gst_event_new_eos()));
+    fail_unless_equals_int(1, gst_harness_buffers_received(h));
+
+    side_release(element, &side);
+    gst_harness_teardown(h);
+    gst_element_set_bus(upstream, NULL);
+    gst_object_unref(upstream);
+    gst_object_unref(element);
+    gst_object_unref(bus);
+}
+GST_END_TEST;
+
+static Suite *
+addtagmux_suite(void)
+{
+    Suite * s = suite_create("addtagmux");
+    TCase * tc = tcase_create("general");
+    tcase_set_timeout(tc, 120);
+    suite_add_tcase(s, tc);
+    tcase_add_test(tc, test_request_release);
+    tcase_add_test(tc, test_release_under_load);
+    tcase_add_test(tc, test_released_order);
+    tcase_add_test(tc, test_upstream_error);
+    return s;
+}
+
+GST_CHECK_MAIN(addtagmux);
@@ -0,0 +1,466 @@
+/* GStreamer
+ * Copyright (C) 2015 Ross Tyler
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+/// Benchmark and stress addtagmux (make bench, make check).
+/// Each pipeline is an appsrc main stream through addtagmux to a fakesink
+/// with an appsrc additional stream of a synthetic JPEG or PNG image
+/// for each of its sink_%u pads.
+/// For each image format, image size, pad count and number of pipelines
+/// run at once (each a thread), many pipelines are run and one JSON line
+/// is written to stdout with
+///	first-buffer-us	latency to the first output buffer
+///			(min, median, p95, max)
+///	pipelines-per-second
+///	peak-rss-kb	of this process, so far
+/// A pipeline that fails, does not end or does not push an image tag
+/// for each additional stream fails the run (exit status 1).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <jpeglib.h>
+#include <zlib.h>
+
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/tag/tag.h>
+
+/// Seconds that a pipeline may take before it fails
+#define TIMEOUT		60
+
+/// A benchmark cell: how its pipelines are made and run,
+/// and what they measured
+typedef struct {
+    gchar const *	format;		// "jpeg" or "png"
+    guint		size;		// of the square image
+    guint		pads;		// additional streams
+    guint		concurrency;	// pipelines at once
+    guint		pipelines;	// to run, in all
+    guint		buffers;	// of the main stream
+    guint		max_width;	// addtagmux property
+    GBytes *		image;		// synthetic
+    gint volatile	next;		// pipeline to run
+    GMutex		mutex;		// lock on the following
+    GArray *		latencies;	// first buffer, in us, of each
+    guint		failed;		// pipelines
+} Cell;
+
+/// What we see on the src pad of addtagmux in a pipeline
+typedef struct {
+    gint64		start;		// monotonic us
+    gint64		first;		// buffer, monotonic us
+    guint		images;		// tagged
+} Run;
+
+/// Encode a synthetic (gradient) size x size RGB JPEG image
+static GBytes *
+image_jpeg(
+    guint		size)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned char * data = NULL;
+    unsigned long length = 0;
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &data, &length);
+    cinfo.image_width = size;
+    cinfo.image_height = size;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 85, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    guint8 * row = g_malloc(size * 3);
+    while (cinfo.next_scanline < size) {
+	guint x;
+	for (x = 0; x < size; ++x) {
+	    row[3 * x] = x * 255 / size;
+	    row[3 * x + 1] = cinfo.next_scanline * 255 / size;
+	    row[3 * x + 2] = (x ^ cinfo.next_scanline) & 255;
+	}
+	JSAMPROW r = row;
+	jpeg_write_scanlines(&cinfo, &r, 1);
+    }
+    g_free(row);
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    GBytes * bytes = g_bytes_new(data, length);
+    free(data);
+    return bytes;
+}
+
+/// Append a PNG chunk
+static void
+png_chunk(
+    GByteArray *	png,
+    gchar const *	type,
+    guint8 const *	data,
+    guint32		length)
+{
+    guint32 be = GUINT32_TO_BE(length);
+    g_byte_array_append(png, (guint8 const *) &be, 4);
+    guint offset = png->len;
+    g_byte_array_append(png, (guint8 const *) type, 4);
+    if (length) {
+	g_byte_array_append(png, data, length);
+    }
+    be = GUINT32_TO_BE(crc32(0, png->data + offset, 4 + length));
+    g_byte_array_append(png, (guint8 const *) &be, 4);
+}
+
+/// Encode a synthetic (gradient) size x size RGB PNG image
+static GBytes *
+image_png(
+    guint		size)
+{
+    gsize stride = 1 + (gsize) size * 3;
+    guint8 * raw = g_malloc(stride * size);
+    guint x, y;
+    for (y = 0; y < size; ++y) {
+	guint8 * row = raw + stride * y;
+	*row++ = 0;	// no filter
+	for (x = 0; x < size; ++x) {
+	    *row++ = x * 255 / size;
+	    *row++ = y * 255 / size;
+	    *row++ = (x ^ y) & 255;
+	}
+    }
+    uLongf length = compressBound(stride * size);
+    guint8 * deflated = g_malloc(length);
+    compress2(deflated, &length, raw, stride * size, Z_DEFAULT_COMPRESSION);
+    g_free(raw);
+
+    GByteArray * png = g_byte_array_new();
+    static guint8 const signature[] = {137, 'P', 'N', 'G', 13, 10, 26, 10};
+    g_byte_array_append(png, signature, sizeof signature);
+    guint8 ihdr[13];
+    guint32 be = GUINT32_TO_BE(size);
+    memcpy(ihdr, &be, 4);
+    memcpy(ihdr + 4, &be, 4);
+    ihdr[8] = 8;	// bits
+    ihdr[9] = 2;	// RGB
+    ihdr[10] = 0;	// deflate
+    ihdr[11] = 0;	// adaptive filtering
+    ihdr[12] = 0;	// not interlaced
+    png_chunk(png, "IHDR", ihdr, sizeof ihdr);
+    png_chunk(png, "IDAT", deflated, length);
+    png_chunk(png, "IEND", NULL, 0);
+    g_free(deflated);
+    return g_byte_array_free_to_bytes(png);
+}
+
+/// Note the first buffer and the images tagged
+static GstPadProbeReturn
+probe(
+    GstPad *		pad,
+    GstPadProbeInfo *	info,
+    gpointer		data)
+{
+    Run * run = data;
+    if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER) {
+	if (!run->first) {
+	    run->first = g_get_monotonic_time();
+	}
+    } else {
+	GstEvent * event = GST_PAD_PROBE_INFO_EVENT(info);
+	if (GST_EVENT_TAG == GST_EVENT_TYPE(event)) {
+	    GstTagList * taglist;
+	    gst_event_parse_tag(event, &taglist);
+	    run->images = gst_tag_list_get_tag_size(taglist, GST_TAG_IMAGE);
+	}
+    }
+    return GST_PAD_PROBE_OK;
+}
+
+/// Make an appsrc, in a bin, with caps
+static GstElement *
+appsrc_new(
+    GstBin *		bin,
+    gchar const *	caps)
+{
+    GstElement * src = gst_element_factory_make("appsrc", NULL);
+    if (!src) {
+	return NULL;
+    }
+    GstCaps * c = gst_caps_from_string(caps);
+    gst_app_src_set_caps(GST_APP_SRC(src), c);
+    gst_caps_unref(c);
+    gst_bin_add(bin, src);
+    return src;
+}
+
+/// Make, run and free a pipeline of a cell.
+/// Return the latency to its first buffer (in us) or -1 if it failed.
+static gint64
+run_pipeline(
+    Cell *		cell)
+{
+    GstElement * pipeline = gst_pipeline_new(NULL);
+    GstBin * bin = GST_BIN(pipeline);
+    GstElement * mux = gst_element_factory_make("addtagmux", NULL);
+    GstElement * sink = gst_element_factory_make("fakesink", NULL);
+    GstElement * src = appsrc_new(bin, "application/octet-stream");
+    if (!mux || !sink || !src) {
+	g_printerr("missing addtagmux, fakesink or appsrc\n");
+	exit(1);
+    }
+    g_object_set(mux, "max-width", cell->max_width, NULL);
+    g_object_set(sink, "sync", FALSE, NULL);
+    gst_bin_add_many(bin, mux, sink, NULL);
+    gboolean linked = gst_element_link_pads(src, "src", mux, "sink")
+	&& gst_element_link_pads(mux, "src", sink, "sink");
+
+    gchar * caps = g_strdup_printf("image/%s", cell->format);
+    GstElement ** sides = g_new(GstElement *, cell->pads);
+    guint i;
+    for (i = 0; i < cell->pads; ++i) {
+	sides[i] = appsrc_new(bin, caps);
+	linked = linked && gst_element_link_pads(sides[i], "src",
+	    mux, "sink_%u");
+    }
+    g_free(caps);
+
+    Run run = {0, 0, 0};
+    GstPad * pad = gst_element_get_static_pad(mux, "src");
+    gst_pad_add_probe(pad,
+	GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+	probe, &run, NULL);
+    gst_object_unref(pad);
+
+    gboolean ok = FALSE;
+    run.start = g_get_monotonic_time();
+    if (linked && GST_STATE_CHANGE_FAILURE
+	    != gst_element_set_state(pipeline, GST_STATE_PLAYING)) {
+	for (i = 0; i < cell->pads; ++i) {
+	    gst_app_src_push_buffer(GST_APP_SRC(sides[i]),
+		gst_buffer_new_wrapped_bytes(cell->image));
+	    gst_app_src_end_of_stream(GST_APP_SRC(sides[i]));
+	}
+	for (i = 0; i < cell->buffers; ++i) {
+	    GstBuffer * buffer = gst_buffer_new_allocate(NULL, 4096, NULL);
+	    gst_buffer_memset(buffer, 0, i, 4096);
+	    gst_app_src_push_buffer(GST_APP_SRC(src), buffer);
+	}
+	gst_app_src_end_of_stream(GST_APP_SRC(src));
+
+	GstBus * bus = gst_element_get_bus(pipeline);
+	GstMessage * message = gst_bus_timed_pop_filtered(bus,
+	    TIMEOUT * GST_SECOND, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+	if (!message) {
+	    g_printerr("timeout\n");
+	} else {
+	    if (GST_MESSAGE_ERROR == GST_MESSAGE_TYPE(message)) {
+		GError * error;
+		gst_message_parse_error(message, &error, NULL);
+		g_printerr("%s\n", error->message);
+		g_error_free(error);
+	    } else {
+		ok = TRUE;
+	    }
+	    gst_message_unref(message);
+	}
+	gst_object_unref(bus);
+    }
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(pipeline);
+    g_free(sides);
+
+    if (ok && run.images != cell->pads) {
+	g_printerr("%u of %u images\n", run.images, cell->pads);
+	ok = FALSE;
+    }
+    return ok && run.first ? run.first - run.start : -1;
+}
+
+/// Run the pipelines of a cell, while there are any, in a thread
+static gpointer
+worker(
+    gpointer		data)
+{
+    Cell * cell = data;
+    while ((guint) g_atomic_int_add(&cell->next, 1) < cell->pipelines) {
+	gint64 latency = run_pipeline(cell);
+	g_mutex_lock(&cell->mutex);
+	if (0 > latency) {
+	    ++cell->failed;
+	} else {
+	    g_array_append_val(cell->latencies, latency);
+	}
+	g_mutex_unlock(&cell->mutex);
+    }
+    return NULL;
+}
+
+static gint
+compare_latency(
+    gconstpointer	a,
+    gconstpointer	b)
+{
+    gint64 la = *(gint64 const *) a;
+    gint64 lb = *(gint64 const *) b;
+    return la < lb ? -1 : la > lb ? 1 : 0;
+}
+
+/// Run a cell and write what it measured as a JSON line.
+/// Return the number of its pipelines that failed.
+static guint
+run_cell(
+    Cell *		cell)
+{
+    cell->image = g_str_equal(cell->format, "png")
+	? image_png(cell->size)
+	: image_jpeg(cell->size);
+    cell->next = 0;
+    g_mutex_init(&cell->mutex);
+    cell->latencies = g_array_new(FALSE, FALSE, sizeof (gint64));
+    cell->failed = 0;
+
+    gint64 start = g_get_monotonic_time();
+    GThread ** threads = g_new(GThread *, cell->concurrency);
+    guint i;
+    for (i = 0; i < cell->concurrency; ++i) {
+	threads[i] = g_thread_new("bench", worker, cell);
+    }
+    for (i = 0; i < cell->concurrency; ++i) {
+	g_thread_join(threads[i]);
+    }
+    g_free(threads);
+    gdouble elapsed = (g_get_monotonic_time() - start) / 1e6;
+
+    g_array_sort(cell->latencies, compare_latency);
+    guint n = cell->latencies->len;
+    gint64 * l = (gint64 *) cell->latencies->data;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("{\"format\": \"%s\", \"size\": %u, \"image-bytes\": %"
+	G_GSIZE_FORMAT ", \"pads\": %u, \"concurrency\": %u,"
+	" \"max-width\": %u, \"pipelines\": %u, \"failed\": %u,"
+	" \"first-buffer-us\": {\"min\": %" G_GINT64_FORMAT
+	", \"median\": %" G_GINT64_FORMAT ", \"p95\": %" G_GINT64_FORMAT
+	", \"max\": %" G_GINT64_FORMAT "},"
+	" \"pipelines-per-second\": %.1f, \"peak-rss-kb\": %ld}\n",
+	cell->format, cell->size, g_bytes_get_size(cell->image),
+	cell->pads, cell->concurrency, cell->max_width,
+	cell->pipelines, cell->failed,
+	n ? l[0] : -1, n ? l[n / 2] : -1, n ? l[n * 95 / 100] : -1,
+	n ? l[n - 1] : -1,
+	elapsed > 0 ? cell->pipelines / elapsed : 0,
+	usage.ru_maxrss);
+    fflush(stdout);
+
+    g_array_unref(cell->latencies);
+    g_mutex_clear(&cell->mutex);
+    g_bytes_unref(cell->image);
+    return cell->failed;
+}
+
+/// Parse a comma separated list of numbers
+static GArray *
+parse_list(
+    gchar const *	list)
+{
+    GArray * array = g_array_new(FALSE, FALSE, sizeof (guint));
+    gchar ** strings = g_strsplit(list, ",", -1);
+    gchar ** s;
+    for (s = strings; *s; ++s) {
+	guint value = strtoul(*s, NULL, 10);
+	g_array_append_val(array, value);
+    }
+    g_strfreev(strings);
+    return array;
+}
+
+int
+main(
+    int			argc,
+    char **		argv)
+{
+    gchar * formats = g_strdup("jpeg,png");
+    gchar * sizes = g_strdup("64,512,2048");
+    gchar * pads = g_strdup("1,4,16");
+    gchar * concurrencies = g_strdup("1,8");
+    guint pipelines = 64;
+    guint buffers = 100;
+    guint max_width = 0;
+    GOptionEntry entries[] = {
+	{"formats", 0, 0, G_OPTION_ARG_STRING, &formats,
+	    "Image formats (jpeg,png)", "LIST"},
+	{"sizes", 0, 0, G_OPTION_ARG_STRING, &sizes,
+	    "Image widths and heights", "LIST"},
+	{"pads", 0, 0, G_OPTION_ARG_STRING, &pads,
+	    "Additional streams in each pipeline", "LIST"},
+	{"concurrency", 0, 0, G_OPTION_ARG_STRING, &concurrencies,
+	    "Pipelines run at once", "LIST"},
+	{"pipelines", 0, 0, G_OPTION_ARG_INT, &pipelines,
+	    "Pipelines run in each cell", "N"},
+	{"buffers", 0, 0, G_OPTION_ARG_INT, &buffers,
+	    "Buffers in each main stream", "N"},
+	{"max-width", 0, 0, G_OPTION_ARG_INT, &max_width,
+	    "Scale images to fit (addtagmux max-width)", "N"},
+	{NULL}
+    };
+    GError * error = NULL;
+    GOptionContext * context = g_option_context_new(
+	"- benchmark and stress addtagmux");
+    g_option_context_add_main_entries(context, entries, NULL);
+    g_option_context_add_group(context, gst_init_get_option_group());
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+	g_printerr("%s\n", error->message);
+	g_error_free(error);
+	return 2;
+    }
+    g_option_context_free(context);
+
+    GArray * size_list = parse_list(sizes);
+    GArray * pads_list = parse_list(pads);
+    GArray * concurrency_list = parse_list(concurrencies);
+    gchar ** format_list = g_strsplit(formats, ",", -1);
+    guint failed = 0;
+    gchar ** format;
+    guint s, p, c;
+    for (format = format_list; *format; ++format) {
+	for (s = 0; s < size_list->len; ++s) {
+	    for (p = 0; p < pads_list->len; ++p) {
+		for (c = 0; c < concurrency_list->len; ++c) {
+		    Cell cell;
+		    cell.format = *format;
+		    cell.size = g_array_index(size_list, guint, s);
+		    cell.pads = g_array_index(pads_list, guint, p);
+		    cell.concurrency
+			= MAX(1, g_array_index(concurrency_list, guint, c));
+		    cell.pipelines = pipelines;
+		    cell.buffers = buffers;
+		    cell.max_width = max_width;
+		    failed += run_cell(&cell);
+		}
+	    }
+	}
+    }
+    g_strfreev(format_list);
+    g_array_unref(concurrency_list);
+    g_array_unref(pads_list);
+    g_array_unref(size_list);
+    g_free(concurrencies);
+    g_free(pads);
+    g_free(sizes);
+    g_free(formats);
+    return failed ? 1 : 0;
+}